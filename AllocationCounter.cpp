@@ -0,0 +1,70 @@
+#include "AllocationStats.h"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global operator new and delete to count allocations in allocation_stripes.
+// Compiled only into the binaries whose metrics report allocations. The array forms forward
+// to these, so every form of new is counted, including the aligned ones that
+// SignatureMatrix's AlignedAllocator and the pmr arenas' upstream resource use.
+
+namespace {
+
+void count_allocation(std::size_t size) {
+    AllocationStripe& stripe = allocation_stripes[thread_index() % NUM_ALLOCATION_STRIPES];
+    stripe.count.fetch_add(1, std::memory_order_relaxed);
+    stripe.bytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+void* allocate(std::size_t size) {
+    count_allocation(size);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void* allocate_aligned(std::size_t size, std::align_val_t alignment) {
+    count_allocation(size);
+    std::size_t align = std::max(static_cast<std::size_t>(alignment), sizeof(void*));
+    void* p = nullptr;
+    return ::posix_memalign(&p, align, size == 0 ? 1 : size) == 0 ? p : nullptr;
+}
+
+}
+
+// Out of line, so the compiler does not see a new paired with free() after inlining.
+__attribute__((noinline)) void* operator new(std::size_t size) {
+    if (void* p = allocate(size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    return allocate(size);
+}
+
+__attribute__((noinline)) void* operator new(std::size_t size, std::align_val_t alignment) {
+    if (void* p = allocate_aligned(size, alignment)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocate_aligned(size, alignment);
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
@@ -0,0 +1,28 @@
+#ifndef ALLOCATION_STATS_H
+#define ALLOCATION_STATS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Allocation counts are kept in cache-line padded stripes, one per thread modulo the stripe
+// count, so the counting operator new does not make every thread contend on one counter.
+// The counting operator new lives in AllocationCounter.cpp; a binary built without it
+// reports no allocations.
+struct alignas(64) AllocationStripe {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> bytes{0};
+};
+
+constexpr size_t NUM_ALLOCATION_STRIPES = 64;
+inline AllocationStripe allocation_stripes[NUM_ALLOCATION_STRIPES];
+
+// Small dense index of the calling thread, in order of first use; also the trace "tid". The
+// first allocation happens during static initialization, so the main thread is thread 0.
+inline uint32_t thread_index() {
+    static std::atomic<uint32_t> nextIndex{0};
+    thread_local uint32_t index = nextIndex.fetch_add(1, std::memory_order_relaxed);
+    return index;
+}
+
+#endif
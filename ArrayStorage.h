@@ -0,0 +1,46 @@
+#ifndef ARRAY_STORAGE_H
+#define ARRAY_STORAGE_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Array that either owns its elements or views memory owned elsewhere, such as a mapped
+// index file. Readers do not care which; the first mutable access copies a view into owned
+// storage, so a loaded index can still be updated in place.
+template<typename T, typename Alloc = std::allocator<T>>
+class ArrayStorage {
+public:
+    const T* data() const { return view ? view : owned.data(); }
+    size_t size() const { return view ? viewSize : owned.size(); }
+    bool empty() const { return size() == 0; }
+    bool isView() const { return view != nullptr; }
+
+    const T& operator[](size_t i) const { return data()[i]; }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + size(); }
+
+    size_t memoryUsage() const { return owned.capacity() * sizeof(T); }
+
+    void attach(const T* ptr, size_t count) {
+        owned = std::vector<T, Alloc>();
+        view = ptr;
+        viewSize = count;
+    }
+
+    std::vector<T, Alloc>& mutableVector() {
+        if (view) {
+            owned.assign(view, view + viewSize);
+            view = nullptr;
+            viewSize = 0;
+        }
+        return owned;
+    }
+
+private:
+    std::vector<T, Alloc> owned;
+    const T* view = nullptr;
+    size_t viewSize = 0;
+};
+
+#endif
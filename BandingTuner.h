@@ -0,0 +1,140 @@
+#ifndef BANDING_TUNER_H
+#define BANDING_TUNER_H
+
+#include "MinHash.h"
+#include "NGram.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Probability that two documents of Jaccard similarity `s` share at least one of `bands`
+// bands of `rows` min-hash slots: the LSH S-curve 1 - (1 - s^r)^b.
+double collision_probability(double s, int bands, int rows) {
+    return 1.0 - std::pow(1.0 - std::pow(s, rows), bands);
+}
+
+struct BandingChoice {
+    int bands = 0;
+    int rows = 0;
+    // Mean probability that a pair below the threshold becomes a candidate, and that a pair at
+    // or above it does not, over similarities spread uniformly on each side.
+    double falsePositive = 1.0;
+    double falseNegative = 1.0;
+    bool meetsTargets = false;
+};
+
+// Mean of the S-curve (or of its complement) over [from, to], by the midpoint rule.
+double mean_collision_probability(double from, double to, int bands, int rows, bool complement) {
+    const int steps = 256;
+    if (to <= from) {
+        return 0.0;
+    }
+    double sum = 0;
+    for (int i = 0; i < steps; ++i) {
+        double p = collision_probability(from + (i + 0.5) * (to - from) / steps, bands, rows);
+        sum += complement ? 1.0 - p : p;
+    }
+    return sum / steps;
+}
+
+// Picks bands x rows (using at most `numHashes` slots) for queries at `threshold`: the fewest
+// false positives among the choices that keep both error rates within the given bounds. If
+// none does, returns the choice that exceeds its bounds by the smallest factor, with
+// meetsTargets unset.
+BandingChoice tune_banding(int numHashes, double threshold, double maxFalsePositive = 1.0,
+                           double maxFalseNegative = 0.01) {
+    BandingChoice best;
+    double bestExcess = 0;
+    for (int bands = 1; bands <= numHashes; ++bands) {
+        for (int rows = 1; bands * rows <= numHashes; ++rows) {
+            BandingChoice choice;
+            choice.bands = bands;
+            choice.rows = rows;
+            choice.falsePositive = mean_collision_probability(0.0, threshold, bands, rows, false);
+            choice.falseNegative = mean_collision_probability(threshold, 1.0, bands, rows, true);
+            choice.meetsTargets = choice.falsePositive <= maxFalsePositive && choice.falseNegative <= maxFalseNegative;
+            double excess = std::max(choice.falsePositive / std::max(maxFalsePositive, 1e-12),
+                                     choice.falseNegative / std::max(maxFalseNegative, 1e-12));
+
+            bool better;
+            if (choice.meetsTargets != best.meetsTargets) {
+                better = choice.meetsTargets;
+            }
+            else if (choice.meetsTargets) {
+                better = choice.falsePositive < best.falsePositive;
+            }
+            else {
+                better = best.bands == 0 || excess < bestExcess;
+            }
+            if (better) {
+                best = choice;
+                bestExcess = excess;
+            }
+        }
+    }
+    return best;
+}
+
+struct BandingValidation {
+    size_t pairsAbove = 0;     // sampled pairs with Jaccard similarity >= threshold
+    size_t pairsBelow = 0;
+    size_t falsePositives = 0; // pairs below the threshold that share a band
+    size_t falseNegatives = 0; // pairs at or above it that share none
+    double falsePositiveRate() const { return pairsBelow ? double(falsePositives) / pairsBelow : 0.0; }
+    double falseNegativeRate() const { return pairsAbove ? double(falseNegatives) / pairsAbove : 0.0; }
+};
+
+// Measures a banding on real data: every pair of `sample` texts is compared by exact Jaccard
+// similarity of their character n-gram sets and by whether their min-hash signatures agree
+// on all slots of some band. Cost is quadratic in the sample size.
+BandingValidation validate_banding(const std::vector<std::string>& sample, const MinHasher& hasher, int ngramSize,
+                                   int bands, int rows, double threshold) {
+    std::vector<std::vector<uint64_t>> shingles(sample.size());
+    std::vector<std::vector<unsigned long>> signatures(sample.size());
+    for (size_t i = 0; i < sample.size(); ++i) {
+        for_each_shingle(sample[i], ngramSize, ShingleUnit::Char, [&](std::string_view shingle) {
+            shingles[i].push_back(hasher.shingleHash(shingle));
+        });
+        std::sort(shingles[i].begin(), shingles[i].end());
+        shingles[i].erase(std::unique(shingles[i].begin(), shingles[i].end()), shingles[i].end());
+        signatures[i] = hasher.fromShingles([&](auto&& add) {
+            for (uint64_t h : shingles[i]) {
+                add(h);
+            }
+        });
+    }
+
+    BandingValidation result;
+    std::vector<uint64_t> common;
+    for (size_t i = 0; i < sample.size(); ++i) {
+        for (size_t j = i + 1; j < sample.size(); ++j) {
+            common.clear();
+            std::set_intersection(shingles[i].begin(), shingles[i].end(), shingles[j].begin(), shingles[j].end(),
+                                  std::back_inserter(common));
+            size_t together = shingles[i].size() + shingles[j].size() - common.size();
+            double similarity = together ? double(common.size()) / together : 1.0;
+
+            bool collides = false;
+            for (int band = 0; band < bands && !collides; ++band) {
+                collides = std::equal(signatures[i].begin() + band * rows, signatures[i].begin() + (band + 1) * rows,
+                                      signatures[j].begin() + band * rows);
+            }
+
+            if (similarity >= threshold) {
+                ++result.pairsAbove;
+                result.falseNegatives += !collides;
+            }
+            else {
+                ++result.pairsBelow;
+                result.falsePositives += collides;
+            }
+        }
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,471 @@
+#include "LSH.h"
+#include "LSHForest.h"
+#include "ReadFile.h"
+#include "Ontology.h"
+#include "WordIndex.h"
+#include "CandidateWords.h"
+#include "NGram.h"
+#include "MinHash.h"
+#include "TextNormalizer.h"
+#include "SyntheticData.h"
+#include "Memory_Usage.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <tbb/global_control.h>
+#include <tbb/task_arena.h>
+
+// Microbenchmarks of the matching primitives and end-to-end runs over generated data.
+// Human-readable lines go to stdout; every result is also written as JSON for tooling.
+
+struct BenchmarkOptions {
+    SyntheticOptions data;
+    std::string filter;
+    std::string outputPath = "benchmark.json";
+    std::string workDir = "/tmp";
+    std::string generatePrefix;
+    double minSeconds = 0.2;
+    int repetitions = 5;
+    int threads = 0;
+    int bands = 25;
+    int hashFuncs = 100;
+    bool micro = true;
+    bool endToEnd = true;
+};
+
+class BenchmarkRunner {
+public:
+    explicit BenchmarkRunner(const BenchmarkOptions& options) : options(options) {}
+
+    // Times `func` (which processes `itemsPerCall` items and returns a value that is kept
+    // alive so the work is not optimized away), calibrating the number of calls per sample so
+    // a sample takes at least minSeconds. Reports the median and best of the samples.
+    template<typename Func>
+    void run(const std::string& name, size_t itemsPerCall, Func&& func) {
+        if (!selected(name)) {
+            return;
+        }
+        size_t calls = 1;
+        for (;;) {
+            double seconds = sample(calls, func);
+            if (seconds >= options.minSeconds || calls >= (size_t(1) << 30)) {
+                break;
+            }
+            calls = seconds <= 0 ? calls * 10 : std::max(calls + 1, static_cast<size_t>(calls * options.minSeconds * 1.2 / seconds));
+        }
+
+        std::vector<double> perItem;
+        for (int i = 0; i < options.repetitions; ++i) {
+            perItem.push_back(sample(calls, func) * 1e9 / (calls * itemsPerCall));
+        }
+        std::sort(perItem.begin(), perItem.end());
+        record(name, "micro", calls * itemsPerCall, perItem[perItem.size() / 2], perItem.front());
+    }
+
+    // Times a single call of `func`, for end-to-end stages too long to repeat.
+    template<typename Func>
+    void runOnce(const std::string& name, size_t items, Func&& func) {
+        if (!selected(name)) {
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        sink += static_cast<uint64_t>(func());
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double nsPerItem = seconds * 1e9 / std::max<size_t>(items, 1);
+        record(name, "end_to_end", items, nsPerItem, nsPerItem);
+    }
+
+    bool selected(const std::string& name) const {
+        return options.filter.empty() || name.find(options.filter) != std::string::npos;
+    }
+
+    bool write(const std::string& filename) const {
+        json report;
+        report["context"] = {
+            {"threads", tbb::this_task_arena::max_concurrency()},
+            {"terms", options.data.numTerms},
+            {"candidates", options.data.numCandidates},
+            {"vocabulary", options.data.vocabularySize},
+            {"max_words_per_term", options.data.maxWordsPerTerm},
+            {"skew", options.data.skew},
+            {"overlap", options.data.overlap},
+            {"seed", options.data.seed},
+            {"bands", options.bands},
+            {"hash_funcs", options.hashFuncs},
+            {"peak_memory_kb", peak_memory_kb()}};
+        report["benchmarks"] = results;
+
+        std::ofstream outFile(filename);
+        if (!outFile.is_open()) {
+            std::cerr << "Failed to open " << filename << std::endl;
+            return false;
+        }
+        outFile << report.dump(2) << "\n";
+        return outFile.good();
+    }
+
+private:
+    const BenchmarkOptions& options;
+    json results = json::array();
+    uint64_t sink = 0;
+
+    template<typename Func>
+    double sample(size_t calls, Func& func) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            sink += static_cast<uint64_t>(func());
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void record(const std::string& name, const std::string& kind, size_t items, double nsPerItem, double bestNsPerItem) {
+        double itemsPerSecond = nsPerItem > 0 ? 1e9 / nsPerItem : 0;
+        std::printf("%-32s %14.1f ns/item %14.0f items/s\n", name.c_str(), nsPerItem, itemsPerSecond);
+        std::fflush(stdout);
+        results.push_back({{"name", name},
+                           {"kind", kind},
+                           {"items", items},
+                           {"ns_per_item", nsPerItem},
+                           {"best_ns_per_item", bestNsPerItem},
+                           {"items_per_second", itemsPerSecond}});
+    }
+};
+
+void run_micro(BenchmarkRunner& runner, const BenchmarkOptions& options) {
+    SyntheticGenerator generator(options.data);
+    const std::vector<std::string>& terms = generator.terms();
+    std::vector<std::string> phrases = generator.candidates();
+    const int n = 3;
+
+    std::vector<std::vector<std::string>> termNgrams;
+    for (const auto& term : terms) {
+        termNgrams.push_back(text_to_ngrams(term, n));
+    }
+    MinHasher hasher(options.hashFuncs);
+    std::vector<std::vector<unsigned long>> termSignatures;
+    for (const auto& ngrams : termNgrams) {
+        termSignatures.push_back(hasher(ngrams));
+    }
+    LSH templateIndex(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, n);
+    int bandSize = options.hashFuncs / options.bands;
+
+    size_t next = 0;
+    auto cycle = [&](size_t count) { return next++ % count; };
+
+    HashFunc hashFunc(1);
+    runner.run("HashFunc", 1, [&]() {
+        const auto& ngrams = termNgrams[cycle(termNgrams.size())];
+        return ngrams.empty() ? 0 : hashFunc(ngrams[0]);
+    });
+    std::vector<HashFunc> hashFuncs;
+    for (int i = 0; i < options.hashFuncs; ++i) {
+        hashFuncs.emplace_back(i + 1);
+    }
+    runner.run("minhash/hash_funcs", 1, [&]() {
+        return minhash(termNgrams[cycle(termNgrams.size())], hashFuncs)[0];
+    });
+    runner.run("minhash/remix", 1, [&]() {
+        return hasher(termNgrams[cycle(termNgrams.size())])[0];
+    });
+    MinHasher onePermutation(options.hashFuncs, MinHashScheme::OnePermutation);
+    runner.run("minhash/one_permutation", 1, [&]() {
+        return onePermutation(termNgrams[cycle(termNgrams.size())])[0];
+    });
+    runner.run("minhash/in_place_shingles", 1, [&]() {
+        const std::string& text = terms[cycle(terms.size())];
+        return hasher.fromShingles([&](auto&& add) {
+            for_each_shingle(text, n, ShingleUnit::Char, [&](std::string_view shingle) {
+                add(hasher.shingleHash(shingle));
+            });
+        })[0];
+    });
+    runner.run("computeBandHash", options.bands, [&]() {
+        const auto& signature = termSignatures[cycle(termSignatures.size())];
+        uint64_t h = 0;
+        for (int band = 0; band < options.bands; ++band) {
+            h ^= templateIndex.computeBandHash(signature, band, band * bandSize, (band + 1) * bandSize);
+        }
+        return h;
+    });
+    runner.run("jaccard_similarity", 1, [&]() {
+        size_t i = cycle(termSignatures.size());
+        return jaccard_similarity(termSignatures[i], termSignatures[(i * 7 + 1) % termSignatures.size()]) > 0.5;
+    });
+
+    runner.run("text_to_ngrams", 1, [&]() {
+        return text_to_ngrams(phrases[cycle(phrases.size())], n).size();
+    });
+    std::vector<std::vector<std::string>> phraseWords;
+    for (const auto& phrase : phrases) {
+        phraseWords.push_back(split(phrase));
+    }
+    runner.run("text_to_ngrams_words", 1, [&]() {
+        return text_to_ngrams_words(phraseWords[cycle(phraseWords.size())], 2).size();
+    });
+    std::vector<std::string_view> views;
+    runner.run("text_to_ngram_views", 1, [&]() {
+        views.clear();
+        text_to_ngram_views(phrases[cycle(phrases.size())], 2, views);
+        return views.size();
+    });
+    // TextNormalizer::normalize replaced filter_string as the query-side text cleaner.
+    const TextNormalizer normalizer(MATCH_STOP_WORDS);
+    std::string normalized;
+    std::vector<std::string_view> words;
+    runner.run("TextNormalizer::normalize", 1, [&]() {
+        normalizer.normalize(phrases[cycle(phrases.size())], normalized, words);
+        return words.size();
+    });
+
+    runner.run("LSH::insert", terms.size(), [&]() {
+        LSH lsh(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, n);
+        for (const auto& term : terms) {
+            lsh.insert(std::string_view(term), term);
+        }
+        lsh.freeze();
+        return lsh.size();
+    });
+    runner.run("LSH::bulk_build", terms.size(), [&]() {
+        LSH lsh(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, n);
+        lsh.bulk_build(terms);
+        return lsh.size();
+    });
+
+    LSH lsh(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, n);
+    lsh.bulk_build(terms);
+    runner.run("LSH::query", 1, [&]() {
+        return lsh.query(std::string_view(phrases[cycle(phrases.size())]), 0.5).size();
+    });
+    runner.run("LSH::query_topk", 1, [&]() {
+        return lsh.query_topk(std::string_view(phrases[cycle(phrases.size())]), 5, 0.5).size();
+    });
+    runner.run("LSH::query/multiprobe", 1, [&]() {
+        return lsh.query(std::string_view(phrases[cycle(phrases.size())]), 0.5, options.bands).size();
+    });
+    std::vector<std::string> batch(phrases.begin(), phrases.begin() + std::min<size_t>(phrases.size(), 1024));
+    std::vector<double> thresholds(batch.size(), 0.5);
+    runner.run("LSH::query_batch", batch.size(), [&]() {
+        return lsh.query_batch(batch, thresholds).size();
+    });
+
+    runner.run("LSHForest::bulk_build", terms.size(), [&]() {
+        LSHForest forest(20, options.hashFuncs, MinHashScheme::Remix, n);
+        forest.bulk_build(terms);
+        return forest.size();
+    });
+    LSHForest forest(20, options.hashFuncs, MinHashScheme::Remix, n);
+    forest.bulk_build(terms);
+    runner.run("LSHForest::query", 1, [&]() {
+        return forest.query(std::string_view(phrases[cycle(phrases.size())]), 0.5).size();
+    });
+    runner.run("LSHForest::query_topk", 1, [&]() {
+        return forest.query_topk(std::string_view(phrases[cycle(phrases.size())]), 5, 0.5).size();
+    });
+    runner.run("LSHForest::query_batch", batch.size(), [&]() {
+        return forest.query_batch(batch, thresholds).size();
+    });
+
+    std::string indexPath = options.workDir + "/benchmark_index.bin";
+    runner.run("LSH::save_to_disk", terms.size(), [&]() {
+        return lsh.save_to_disk(indexPath);
+    });
+    runner.run("LSH::load_from_disk", terms.size(), [&]() {
+        LSH loaded(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, n);
+        return loaded.load_from_disk(indexPath);
+    });
+    runner.run("LSH::load_from_disk/checksum", terms.size(), [&]() {
+        LSH loaded(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, n);
+        return loaded.load_from_disk(indexPath, true);
+    });
+    std::remove(indexPath.c_str());
+}
+
+// Runs the stages of match() over a generated ontology and candidate file: parsing, index
+// build, save and reload, then streaming the candidates through normalization and queries.
+void run_end_to_end(BenchmarkRunner& runner, const BenchmarkOptions& options) {
+    std::string prefix = options.workDir + "/benchmark_data";
+    std::string ontologyPath = prefix + ".json";
+    std::string candidatePath = prefix + ".csv";
+    std::string indexPath = prefix + ".bin";
+    const int n = 3;
+
+    runner.runOnce("e2e/generate", options.data.numTerms + options.data.numCandidates, [&]() {
+        SyntheticGenerator generator(options.data);
+        return generator.writeOntology(ontologyPath) && generator.writeCandidates(candidatePath);
+    });
+
+    std::vector<std::string> ontologies;
+    runner.runOnce("e2e/parse_ontology", options.data.numTerms, [&]() {
+        std::unordered_map<std::string, std::pair<std::string, std::string>> index;
+        tbb::concurrent_unordered_map<std::string, std::string> inverted;
+        json j = process_json(ontologyPath);
+        ontologies = parseJson(j, index, inverted);
+        return ontologies.size();
+    });
+    std::string snapshotPath = prefix + ".snap";
+    runner.runOnce("e2e/stream_ontology", options.data.numTerms, [&]() {
+        Ontology ontology;
+        OntologySourceStamp stamp;
+        return ontology.parse(ontologyPath) && source_stamp(ontologyPath, stamp) &&
+               ontology.saveSnapshot(snapshotPath, stamp);
+    });
+    runner.runOnce("e2e/map_ontology_snapshot", options.data.numTerms, [&]() {
+        Ontology ontology;
+        return ontology.load(ontologyPath, snapshotPath) && ontology.isMapped();
+    });
+
+    {
+        LSH lsh(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, n);
+        runner.runOnce("e2e/bulk_build", ontologies.size(), [&]() {
+            lsh.bulk_build(ontologies);
+            return lsh.size();
+        });
+        runner.runOnce("e2e/save_to_disk", ontologies.size(), [&]() {
+            return lsh.save_to_disk(indexPath);
+        });
+    }
+
+    LSH lsh(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, n);
+    runner.runOnce("e2e/load_from_disk", ontologies.size(), [&]() {
+        return lsh.load_from_disk(indexPath, false, true);
+    });
+
+    // The word index match() builds: every word bigram and word -> recipes, read with the same
+    // stream options.
+    runner.runOnce("e2e/word_index", options.data.numCandidates, [&]() {
+        WordIndex bigrams, words;
+        std::atomic<size_t> numKeys{0};
+        streamCSV(candidatePath, [&](const std::vector<CandidateRecord>& records) {
+            std::vector<std::string> addedBigrams, addedWords;
+            index_candidate_words(records, bigrams, words, addedBigrams, addedWords);
+            numKeys += addedBigrams.size() + addedWords.size();
+        }, candidate_stream_options());
+        bigrams.finish();
+        words.finish();
+        return numKeys.load();
+    });
+
+    // Same query pattern as match(): every distinct word bigram at 0.5, every word at 0.9, in
+    // the order the word index first meets them.
+    runner.runOnce("e2e/match", options.data.numCandidates, [&]() {
+        WordIndex bigrams, words;
+        std::atomic<size_t> numMatches{0};
+        streamCSV(candidatePath, [&](const std::vector<CandidateRecord>& records) {
+            std::vector<std::string> addedBigrams, addedWords;
+            index_candidate_words(records, bigrams, words, addedBigrams, addedWords);
+            std::vector<std::string> queries;
+            std::vector<double> thresholds;
+            for (auto& key : addedBigrams) {
+                queries.push_back(std::move(key));
+                thresholds.push_back(0.5);
+            }
+            for (auto& key : addedWords) {
+                queries.push_back(std::move(key));
+                thresholds.push_back(0.9);
+            }
+            for (const auto& ids : lsh.query_batch(queries, thresholds)) {
+                numMatches += ids.size();
+            }
+        }, candidate_stream_options());
+        return numMatches.load();
+    });
+
+    std::remove(ontologyPath.c_str());
+    std::remove(candidatePath.c_str());
+    std::remove(indexPath.c_str());
+    std::remove(snapshotPath.c_str());
+}
+
+int main(int argc, char** argv) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--terms" && hasValue) {
+            options.data.numTerms = std::stoul(argv[++i]);
+        }
+        else if (arg == "--candidates" && hasValue) {
+            options.data.numCandidates = std::stoul(argv[++i]);
+        }
+        else if (arg == "--vocabulary" && hasValue) {
+            options.data.vocabularySize = std::stoul(argv[++i]);
+        }
+        else if (arg == "--words" && hasValue) {
+            options.data.maxWordsPerTerm = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--skew" && hasValue) {
+            options.data.skew = std::stod(argv[++i]);
+        }
+        else if (arg == "--overlap" && hasValue) {
+            options.data.overlap = std::stod(argv[++i]);
+        }
+        else if (arg == "--seed" && hasValue) {
+            options.data.seed = std::stoull(argv[++i]);
+        }
+        else if (arg == "--filter" && hasValue) {
+            options.filter = argv[++i];
+        }
+        else if (arg == "--min-time" && hasValue) {
+            options.minSeconds = std::stod(argv[++i]);
+        }
+        else if (arg == "--repetitions" && hasValue) {
+            options.repetitions = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (arg == "--threads" && hasValue) {
+            options.threads = std::stoi(argv[++i]);
+        }
+        else if (arg == "--output" && hasValue) {
+            options.outputPath = argv[++i];
+        }
+        else if (arg == "--workdir" && hasValue) {
+            options.workDir = argv[++i];
+        }
+        else if (arg == "--generate" && hasValue) {
+            options.generatePrefix = argv[++i];
+        }
+        else if (arg == "--micro-only") {
+            options.endToEnd = false;
+        }
+        else if (arg == "--e2e-only") {
+            options.micro = false;
+        }
+        else {
+            std::cout << "Usage: ./Benchmark [--terms n] [--candidates n] [--vocabulary n] [--words n] [--skew s]\n"
+                         "                   [--overlap f] [--seed n] [--filter name] [--min-time seconds]\n"
+                         "                   [--repetitions n] [--threads n] [--output file.json] [--workdir dir]\n"
+                         "                   [--micro-only | --e2e-only] [--generate prefix]\n";
+            return -1;
+        }
+    }
+
+    if (options.data.vocabularySize == 0 || options.data.numTerms == 0 || options.data.numCandidates == 0) {
+        std::cerr << "--terms, --candidates and --vocabulary must be positive" << std::endl;
+        return -1;
+    }
+
+    // Only write [prefix].json and [prefix].csv, for timing ./EntityMatching on them.
+    if (!options.generatePrefix.empty()) {
+        SyntheticGenerator generator(options.data);
+        return generator.writeOntology(options.generatePrefix + ".json") &&
+               generator.writeCandidates(options.generatePrefix + ".csv") ? 0 : 1;
+    }
+
+    std::unique_ptr<tbb::global_control> threadLimit;
+    if (options.threads > 0) {
+        threadLimit = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, options.threads);
+    }
+
+    BenchmarkRunner runner(options);
+    if (options.micro) {
+        run_micro(runner, options);
+    }
+    if (options.endToEnd) {
+        run_end_to_end(runner, options);
+    }
+    return runner.write(options.outputPath) ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+#ifndef BUCKET_TABLE_H
+#define BUCKET_TABLE_H
+
+#include "ArrayStorage.h"
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <tbb/concurrent_vector.h>
+#include <tbb/parallel_sort.h>
+
+// Read-only view of one bucket's document IDs.
+struct Postings {
+    const uint32_t* first = nullptr;
+    const uint32_t* last = nullptr;
+
+    const uint32_t* begin() const { return first; }
+    const uint32_t* end() const { return last; }
+    size_t size() const { return last - first; }
+    bool empty() const { return first == last; }
+};
+
+// Buckets of one LSH band keyed by a 64-bit band hash.
+// Entries are appended concurrently into a staging area; freeze() sorts them by key and lays
+// the buckets out in compressed-sparse-row form: every bucket is a sorted, duplicate-free run
+// of document IDs in one postings array, and a flat open-addressing table (linear probing,
+// load factor <= 1/2) maps each key to its run. The frozen table is read-only.
+class BucketTable {
+public:
+    // An empty slot has count == 0; every stored bucket holds at least one ID.
+    struct Slot {
+        uint64_t key;
+        uint32_t begin;
+        uint32_t count;
+    };
+
+    void insert(uint64_t key, uint32_t docID) {
+        pending.emplace_back(key, docID);
+    }
+
+    bool hasPending() const { return !pending.empty(); }
+    size_t size() const {
+        size_t numBuckets = 0;
+        for (const auto& slot : slots) {
+            numBuckets += slot.count != 0;
+        }
+        return numBuckets;
+    }
+
+    size_t numPostings() const { return postings.size(); }
+
+    size_t memoryUsage() const {
+        return slots.memoryUsage() + postings.memoryUsage();
+    }
+
+    void freeze() {
+        if (pending.empty()) {
+            return;
+        }
+        rebuild({});
+    }
+
+    // Adds a whole batch of (key, docID) entries and freezes, bypassing the concurrent staging
+    // area; this is how bulk builds load each band.
+    void bulkLoad(std::vector<std::pair<uint64_t, uint32_t>>&& entries) {
+        rebuild(std::move(entries));
+    }
+
+    // Returns the document IDs stored under `key`; empty if none. Only valid on a frozen table.
+    Postings find(uint64_t key) const {
+        if (slots.empty()) {
+            return {};
+        }
+        for (size_t pos = key & mask;; pos = (pos + 1) & mask) {
+            const Slot& slot = slots[pos];
+            if (slot.count == 0) {
+                return {};
+            }
+            if (slot.key == key) {
+                return {postings.data() + slot.begin, postings.data() + slot.begin + slot.count};
+            }
+        }
+    }
+
+    template<typename Func>
+    void forEach(Func&& func) const {
+        for (const auto& slot : slots) {
+            if (slot.count != 0) {
+                func(slot.key, Postings{postings.data() + slot.begin, postings.data() + slot.begin + slot.count});
+            }
+        }
+    }
+
+    // Raw tables, exposed for the on-disk index format.
+    const ArrayStorage<Slot>& slotData() const { return slots; }
+    const ArrayStorage<uint32_t>& postingData() const { return postings; }
+
+    // Serves a frozen table straight from external memory holding the raw slot and postings
+    // arrays; `numSlots` must be a power of two.
+    void attach(const Slot* slotPtr, size_t numSlots, const uint32_t* postingPtr, size_t numPostings) {
+        pending.clear();
+        slots.attach(slotPtr, numSlots);
+        postings.attach(postingPtr, numPostings);
+        mask = numSlots == 0 ? 0 : numSlots - 1;
+    }
+
+private:
+    tbb::concurrent_vector<std::pair<uint64_t, uint32_t>> pending;
+    ArrayStorage<Slot> slots;
+    ArrayStorage<uint32_t> postings;
+    size_t mask = 0;
+
+    // Merges `entries`, the staged inserts and the current buckets into a fresh frozen layout.
+    void rebuild(std::vector<std::pair<uint64_t, uint32_t>>&& entries) {
+        entries.reserve(entries.size() + pending.size() + postings.size());
+        forEach([&](uint64_t key, Postings bucket) {
+            for (uint32_t docID : bucket) {
+                entries.emplace_back(key, docID);
+            }
+        });
+        entries.insert(entries.end(), pending.begin(), pending.end());
+        pending.clear();
+
+        tbb::parallel_sort(entries.begin(), entries.end());
+        entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+
+        std::vector<Slot> runs;
+        auto& ids = postings.mutableVector();
+        ids.clear();
+        ids.reserve(entries.size());
+        for (size_t i = 0; i < entries.size();) {
+            Slot run{entries[i].first, static_cast<uint32_t>(ids.size()), 0};
+            for (; i < entries.size() && entries[i].first == run.key; ++i) {
+                ids.push_back(entries[i].second);
+                ++run.count;
+            }
+            runs.push_back(run);
+        }
+
+        size_t capacity = 16;
+        while (capacity < runs.size() * 2) {
+            capacity <<= 1;
+        }
+        mask = capacity - 1;
+        auto& table = slots.mutableVector();
+        table.assign(capacity, Slot{0, 0, 0});
+        for (const Slot& run : runs) {
+            size_t pos = run.key & mask;
+            while (table[pos].count != 0) {
+                pos = (pos + 1) & mask;
+            }
+            table[pos] = run;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef CANDIDATE_WORDS_H
+#define CANDIDATE_WORDS_H
+
+#include "ReadFile.h"
+#include "Metrics.h"
+#include "NGram.h"
+#include "TextNormalizer.h"
+#include "WordIndex.h"
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Candidate rows as matching reads them: one ingredient per recipe, the first in the file, with
+// the parsing of each block timed as the csv_parse stage.
+CSVStreamOptions candidate_stream_options() {
+    CSVStreamOptions streamOptions;
+    streamOptions.firstRowPerRecipe = true;
+    streamOptions.parse = [](std::string_view text, std::vector<CandidateRecord>& records) {
+        ScopedStage stage("csv_parse");
+        parse_candidate_block(text, records);
+    };
+    return streamOptions;
+}
+
+// Adds the word bigrams and words of `records` to `bigrams` and `words`, appending the keys
+// each index had not seen before to `addedBigrams` and `addedWords`.
+void index_candidate_words(const std::vector<CandidateRecord>& records, WordIndex& bigrams, WordIndex& words,
+                           std::vector<std::string>& addedBigrams, std::vector<std::string>& addedWords) {
+    // A block seldom holds more distinct n-grams of either kind than records.
+    WordIndex::Batch localBigrams(records.size());
+    WordIndex::Batch localWords(records.size());
+
+    const TextNormalizer normalizer(MATCH_STOP_WORDS);
+    std::string normalized;
+    std::vector<std::string_view> tokens;
+    std::vector<std::string_view> ngrams;
+    for (const auto& record : records) {
+        // Recipe IDs are all digits (parseLexMaprLine checks); any too long for 64 bits is skipped.
+        uint64_t recipeID = 0;
+        const char* idEnd = record.recipeID.data() + record.recipeID.size();
+        auto parsed = std::from_chars(record.recipeID.data(), idEnd, recipeID);
+        if (parsed.ec != std::errc() || parsed.ptr != idEnd) {
+            continue;
+        }
+        normalizer.normalize(record.ingredient, normalized, tokens);
+
+        ngrams.clear();
+        text_to_ngram_views(normalized, 2, ngrams);
+        for (std::string_view ngram : ngrams) {
+            localBigrams.add(ngram, recipeID);
+        }
+
+        ngrams.clear();
+        text_to_ngram_views(normalized, 1, ngrams);
+        for (std::string_view ngram : ngrams) {
+            localWords.add(ngram, recipeID);
+        }
+    }
+
+    bigrams.merge(localBigrams, addedBigrams);
+    words.merge(localWords, addedWords);
+}
+
+#endif
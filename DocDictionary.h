@@ -0,0 +1,136 @@
+#ifndef DOC_DICTIONARY_H
+#define DOC_DICTIONARY_H
+
+#include "MinHash.h"
+#include "ArrayStorage.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Maps document labels to dense uint32_t IDs in insertion order.
+// Labels are stored back to back in one arena; lookups go through a linear-probing table of
+// IDs tagged with the upper half of the label hash, so most misses never touch the arena.
+// Not thread-safe: callers serialize intern().
+class DocDictionary {
+public:
+    static constexpr uint32_t NOT_FOUND = UINT32_MAX;
+
+    struct Slot {
+        uint32_t id;
+        uint32_t tag;
+    };
+
+    DocDictionary() {
+        clear();
+    }
+
+    uint32_t intern(std::string_view label) {
+        uint64_t h = hashLabel(label);
+        size_t pos = findSlot(label, h);
+        if (slots[pos].id != NOT_FOUND) {
+            return slots[pos].id;
+        }
+
+        uint32_t id = static_cast<uint32_t>(size());
+        auto& chars = arena.mutableVector();
+        chars.insert(chars.end(), label.begin(), label.end());
+        offsets.mutableVector().push_back(chars.size());
+        slots.mutableVector()[pos] = Slot{id, static_cast<uint32_t>(h >> 32)};
+
+        if (size() * 2 > slots.size()) {
+            rehash(slots.size() * 2);
+        }
+        return id;
+    }
+
+    // Gives an existing label a fresh ID (appending a copy of it) and returns the new ID; the
+    // old ID keeps resolving to the label but find() no longer returns it.
+    uint32_t reassign(std::string_view label) {
+        uint64_t h = hashLabel(label);
+        size_t pos = findSlot(label, h);
+        if (slots[pos].id == NOT_FOUND) {
+            return intern(label);
+        }
+
+        uint32_t id = static_cast<uint32_t>(size());
+        auto& chars = arena.mutableVector();
+        chars.insert(chars.end(), label.begin(), label.end());
+        offsets.mutableVector().push_back(chars.size());
+        slots.mutableVector()[pos].id = id;
+        return id;
+    }
+
+    uint32_t find(std::string_view label) const {
+        return slots[findSlot(label, hashLabel(label))].id;
+    }
+
+    std::string_view label(uint32_t id) const {
+        return std::string_view(arena.data() + offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    size_t size() const { return offsets.size() - 1; }
+
+    size_t memoryUsage() const {
+        return arena.memoryUsage() + offsets.memoryUsage() + slots.memoryUsage();
+    }
+
+    void clear() {
+        arena.mutableVector().clear();
+        offsets.mutableVector().assign(1, 0);
+        slots.mutableVector().assign(16, Slot{NOT_FOUND, 0});
+    }
+
+    // Raw tables, exposed for the on-disk index format.
+    const ArrayStorage<char>& arenaData() const { return arena; }
+    const ArrayStorage<uint64_t>& offsetData() const { return offsets; }
+    const ArrayStorage<Slot>& slotData() const { return slots; }
+
+    // Serves the dictionary straight from external memory holding the three raw tables.
+    void attach(const char* arenaPtr, size_t arenaSize, const uint64_t* offsetPtr, size_t numOffsets,
+                const Slot* slotPtr, size_t numSlots) {
+        arena.attach(arenaPtr, arenaSize);
+        offsets.attach(offsetPtr, numOffsets);
+        slots.attach(slotPtr, numSlots);
+    }
+
+private:
+    ArrayStorage<char> arena;
+    ArrayStorage<uint64_t> offsets;
+    ArrayStorage<Slot> slots;
+
+    static uint64_t hashLabel(std::string_view label) {
+        return hash_bytes(label.data(), label.size(), 0x5bd1e995);
+    }
+
+    // Returns the slot holding `label`, or the empty slot where it would be inserted.
+    size_t findSlot(std::string_view label, uint64_t h) const {
+        size_t mask = slots.size() - 1;
+        uint32_t tag = static_cast<uint32_t>(h >> 32);
+        for (size_t pos = h & mask;; pos = (pos + 1) & mask) {
+            const Slot& slot = slots[pos];
+            if (slot.id == NOT_FOUND || (slot.tag == tag && this->label(slot.id) == label)) {
+                return pos;
+            }
+        }
+    }
+
+    void rehash(size_t capacity) {
+        auto& table = slots.mutableVector();
+        table.assign(capacity, Slot{NOT_FOUND, 0});
+        size_t mask = capacity - 1;
+        for (uint32_t id = 0; id < size(); ++id) {
+            uint64_t h = hashLabel(label(id));
+            uint32_t tag = static_cast<uint32_t>(h >> 32);
+            size_t pos = h & mask;
+            // A reassigned label appears under several IDs; the latest one wins.
+            while (table[pos].id != NOT_FOUND &&
+                   !(table[pos].tag == tag && label(table[pos].id) == label(id))) {
+                pos = (pos + 1) & mask;
+            }
+            table[pos] = Slot{id, tag};
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include "MinHash.h"
+#include "MappedFile.h"
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <tbb/parallel_for.h>
+
+// On-disk LSH index, laid out so a mapped file can be queried in place:
+//
+//   IndexHeader | IndexSection[numSections] | sections, each starting on a 64-byte boundary
+//
+// All integers are host-endian; `endianMarker` lets a reader on another architecture reject
+// the file instead of misreading it. Every section carries its own hash, so the checksum can
+// be verified one section per task, and the header checksum covers the parameters as well.
+constexpr char INDEX_MAGIC[8] = {'O', 'M', 'L', 'S', 'H', 'I', 'D', 'X'};
+constexpr uint32_t INDEX_VERSION = 2;
+constexpr uint32_t INDEX_ENDIAN_MARKER = 0x01020304;
+constexpr size_t INDEX_ALIGNMENT = 64;
+
+enum class SectionKind : uint32_t {
+    DictArena = 1,
+    DictOffsets = 2,
+    DictSlots = 3,
+    Signatures = 4,
+    BucketSlots = 5,
+    BucketPostings = 6,
+    DeltaSlots = 7,
+    DeltaPostings = 8,
+    Tombstones = 9,
+    Bandings = 10,
+    // Ontology snapshots (Ontology.h) use the same container under their own magic.
+    OntologyArena = 11,
+    OntologyOffsets = 12,
+    OntologySource = 13
+};
+
+struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endianMarker;
+    uint32_t headerSize;
+    uint32_t numSections;
+    uint32_t numHashes;
+    uint32_t numBands;
+    uint32_t bandSize;
+    uint32_t signatureBits;
+    uint32_t ngramSize;
+    uint32_t scheme;
+    uint64_t seed;
+    uint64_t numDocs;
+    uint64_t contentHash;
+    uint64_t checksum;
+};
+
+struct IndexSection {
+    uint32_t kind;
+    uint32_t band;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t checksum;
+};
+
+// One banding of the signatures; the first record repeats the header's numBands and bandSize.
+// Files without a Bandings section have only that one.
+struct BandingRecord {
+    uint32_t bands;
+    uint32_t rows;
+    double threshold;
+};
+
+static_assert(sizeof(IndexHeader) == 80, "IndexHeader must not contain padding");
+static_assert(sizeof(BandingRecord) == 16, "BandingRecord must not contain padding");
+static_assert(sizeof(IndexSection) == 32, "IndexSection must not contain padding");
+
+uint64_t section_checksum(const void* data, size_t size, uint32_t index) {
+    return hash_bytes(data, size, 0x8F1BBCDCULL + index);
+}
+
+// Covers the header fields (with the checksum field zeroed) and every section checksum.
+uint64_t index_checksum(IndexHeader header, const std::vector<IndexSection>& sections) {
+    header.checksum = 0;
+    uint64_t h = hash_bytes(&header, sizeof(header), sections.size());
+    for (const auto& section : sections) {
+        h = mix64(h ^ section.checksum);
+    }
+    return h;
+}
+
+// Creates an empty file with a unique name next to `filename`, to be written and renamed over
+// it, so that processes saving the same file at once never write to the same temporary.
+// Returns its name, or an empty string if it could not be created.
+std::string create_temp_file(const std::string& filename) {
+    std::string tempname = filename + ".XXXXXX";
+    int fd = ::mkstemp(tempname.data());
+    if (fd < 0) {
+        return std::string();
+    }
+    ::close(fd);
+    return tempname;
+}
+
+// Collects raw sections and writes them with the header and section table in front.
+class IndexWriter {
+public:
+    void add(SectionKind kind, uint32_t band, const void* data, size_t size) {
+        IndexSection section{static_cast<uint32_t>(kind), band, 0, size,
+                             section_checksum(data, size, static_cast<uint32_t>(sections.size()))};
+        sections.push_back(section);
+        payloads.push_back(static_cast<const char*>(data));
+    }
+
+    // Writes to a temporary file and renames it over `filename`, so a reader that has the old
+    // index mapped (possibly the caller itself) keeps a consistent view.
+    bool write(const std::string& filename, IndexHeader header, const char (&magic)[8] = INDEX_MAGIC,
+               uint32_t version = INDEX_VERSION) {
+        std::string tempname = create_temp_file(filename);
+        if (tempname.empty()) {
+            std::cerr << "Failed to create a temporary file for: " << filename << std::endl;
+            return false;
+        }
+        std::ofstream outFile(tempname, std::ios::binary | std::ios::trunc);
+        if (!outFile.is_open()) {
+            std::cerr << "Failed to open file: " << tempname << std::endl;
+            std::remove(tempname.c_str());
+            return false;
+        }
+
+        uint64_t offset = align(sizeof(IndexHeader) + sections.size() * sizeof(IndexSection));
+        for (auto& section : sections) {
+            section.offset = offset;
+            offset = align(offset + section.size);
+        }
+
+        std::memcpy(header.magic, magic, sizeof(header.magic));
+        header.version = version;
+        header.endianMarker = INDEX_ENDIAN_MARKER;
+        header.headerSize = sizeof(IndexHeader);
+        header.numSections = static_cast<uint32_t>(sections.size());
+        header.checksum = index_checksum(header, sections);
+
+        outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        outFile.write(reinterpret_cast<const char*>(sections.data()), sections.size() * sizeof(IndexSection));
+        uint64_t written = sizeof(IndexHeader) + sections.size() * sizeof(IndexSection);
+
+        static const char zeros[INDEX_ALIGNMENT] = {};
+        for (size_t i = 0; i < sections.size(); ++i) {
+            outFile.write(zeros, sections[i].offset - written);
+            outFile.write(payloads[i], sections[i].size);
+            written = sections[i].offset + sections[i].size;
+        }
+        outFile.write(zeros, align(written) - written);
+
+        outFile.close();
+        if (!outFile.good()) {
+            std::cerr << "Failed to write file: " << tempname << std::endl;
+            std::remove(tempname.c_str());
+            return false;
+        }
+        if (std::rename(tempname.c_str(), filename.c_str()) != 0) {
+            std::cerr << "Failed to replace file: " << filename << std::endl;
+            std::remove(tempname.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    std::vector<IndexSection> sections;
+    std::vector<const char*> payloads;
+
+    static uint64_t align(uint64_t offset) {
+        return (offset + INDEX_ALIGNMENT - 1) / INDEX_ALIGNMENT * INDEX_ALIGNMENT;
+    }
+};
+
+// Maps an index file and validates its header and section table (and, optionally, the
+// checksum) without copying any section.
+class IndexReader {
+public:
+    bool open(const std::string& filename, bool verifyChecksum = true, const char (&magic)[8] = INDEX_MAGIC,
+              uint32_t version = INDEX_VERSION) {
+        file = std::make_shared<MappedFile>();
+        if (!file->open(filename)) {
+            return fail(filename, "cannot be mapped");
+        }
+        if (file->size() < sizeof(IndexHeader)) {
+            return fail(filename, "is too small to be an index");
+        }
+
+        std::memcpy(&header, file->data(), sizeof(header));
+        if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0) {
+            return fail(filename, "has the wrong file type (bad magic)");
+        }
+        if (header.endianMarker != INDEX_ENDIAN_MARKER) {
+            return fail(filename, "was written on a machine with different byte order");
+        }
+        if (header.version != version) {
+            return fail(filename, "has unsupported version " + std::to_string(header.version));
+        }
+        if (header.headerSize != sizeof(IndexHeader) ||
+            file->size() < sizeof(IndexHeader) + uint64_t(header.numSections) * sizeof(IndexSection)) {
+            return fail(filename, "has a truncated header");
+        }
+
+        const IndexSection* table = reinterpret_cast<const IndexSection*>(file->data() + sizeof(IndexHeader));
+        sections.assign(table, table + header.numSections);
+        for (const auto& section : sections) {
+            if (section.offset % INDEX_ALIGNMENT != 0 || section.offset > file->size() ||
+                section.size > file->size() - section.offset) {
+                return fail(filename, "has a section outside the file");
+            }
+        }
+
+        if (verifyChecksum) {
+            std::vector<char> valid(sections.size());
+            tbb::parallel_for(size_t(0), sections.size(), [&](size_t i) {
+                valid[i] = section_checksum(file->data() + sections[i].offset, sections[i].size,
+                                            static_cast<uint32_t>(i)) == sections[i].checksum;
+            });
+            for (char ok : valid) {
+                if (!ok) {
+                    return fail(filename, "is corrupt (section checksum mismatch)");
+                }
+            }
+            if (index_checksum(header, sections) != header.checksum) {
+                return fail(filename, "is corrupt (checksum mismatch)");
+            }
+        }
+        return true;
+    }
+
+    const IndexHeader& getHeader() const { return header; }
+    std::shared_ptr<MappedFile> mapping() const { return file; }
+
+    // Locates a section; `count` receives its size in elements of T.
+    template<typename T>
+    const T* section(SectionKind kind, uint32_t band, size_t& count) const {
+        for (const auto& s : sections) {
+            if (s.kind == static_cast<uint32_t>(kind) && s.band == band && s.size % sizeof(T) == 0) {
+                count = s.size / sizeof(T);
+                return reinterpret_cast<const T*>(file->data() + s.offset);
+            }
+        }
+        count = 0;
+        return nullptr;
+    }
+
+private:
+    std::shared_ptr<MappedFile> file;
+    IndexHeader header{};
+    std::vector<IndexSection> sections;
+
+    bool fail(const std::string& filename, const std::string& reason) {
+        std::cerr << "Index file " << filename << " " << reason << std::endl;
+        file.reset();
+        return false;
+    }
+};
+
+#endif
@@ -2,219 +2,1008 @@
 #define LSH_H
 
 #include "MinHash.h"
+#include "SignatureMatrix.h"
+#include "BucketTable.h"
+#include "DocDictionary.h"
+#include "IndexFile.h"
+#include "NGram.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <functional>
-#include <sstream>
-#include <iomanip>
 #include <unordered_set>
 #include <map>
 #include <fstream>
-#include <openssl/sha.h>
-#include <tbb/concurrent_unordered_map.h>
-#include <tbb/concurrent_vector.h>
+#include <atomic>
+#include <mutex>
+#include <future>
+#include <shared_mutex>
 #include <tbb/parallel_for.h>
-#include <tbb/parallel_for_each.h>
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <tbb/spin_mutex.h>
 
 class LSH {
 public:
-    LSH(int numBands, int numHashes = 100) : numBands(numBands), bandSize(numHashes / numBands), buckets(numBands) {
-        for (int i = 0; i < numHashes; ++i) {
-            hashFuncs.emplace_back(i); // Initialize HashFunc objects with different seeds
+    // One way of cutting the signatures into `bands` bands of `rows` slots, with its own tables
+    // buckets[firstTable, firstTable + bands). `threshold` is the similarity it is sized for.
+    struct Banding {
+        int bands;
+        int rows;
+        double threshold;
+        int firstTable;
+    };
+
+    LSH(int numBands, int numHashes = 100, MinHashScheme scheme = MinHashScheme::Remix, int signatureBits = 16,
+        int ngramSize = 3)
+        : ngramSize(ngramSize), hasher(numHashes, scheme), signatures(numHashes, signatureBits),
+          bandings{primaryBanding(numBands, numHashes / numBands)}, numTables(numBands), buckets(numBands),
+          delta(numBands) {}
+
+    ~LSH() {
+        wait_for_compaction();
+    }
+
+    void insert(const std::vector<std::string>& ngrams, const std::string& docID) {
+        insert_signature(minhash(ngrams, hasher), docID);
+    }
+
+    // Shingles `text` with the index's n-gram size and hashes the shingles in place.
+    void insert(std::string_view text, const std::string& docID) {
+        insert_signature(signatureOf(text), docID);
+    }
+
+    // Adds a document to the delta segment, replacing it if `docID` is already indexed: the
+    // label then moves to a fresh ID and the old ID is tombstoned, so no band entry is rewritten.
+    void insert_signature(const std::vector<unsigned long>& minhashSignature, const std::string& docID) {
+        wait_for_compaction();
+        AlignedWords packed = signatures.pack(minhashSignature);
+        uint32_t id;
+        {
+            tbb::spin_mutex::scoped_lock lock(mutex_for_signatures);
+            id = assignID(docID);
+            signatures.append(packed.data());
         }
-        for (int i = 0; i < numBands; ++i) {
-            buckets[i] = tbb::concurrent_unordered_map<std::string, tbb::concurrent_vector<std::string>>();
+
+        for (const Banding& banding : bandings) {
+            for (int band = 0; band < banding.bands; ++band) {
+                delta[banding.firstTable + band].insert(bandKey(minhashSignature, banding, band), id);
+            }
         }
+        frozen.store(false, std::memory_order_release);
     }
 
-    void insert(const std::vector<std::string>& ngrams, const std::string& docID) {
-        auto minhashSignature = minhash(ngrams, hashFuncs);
-        signatures[docID] = minhashSignature;
+    // Replaces an indexed document; returns false, changing nothing, if `docID` is not indexed.
+    bool update(std::string_view text, const std::string& docID) {
+        if (!contains(docID)) {
+            return false;
+        }
+        insert(text, docID);
+        return true;
+    }
 
-        for (int band = 0; band < numBands; ++band) {
-            int start = band * bandSize;
-            int end = (band + 1) * bandSize;
-            std::string bandHash = computeBandHash(minhashSignature, start, end);
+    // Tombstones a document: queries stop returning it at once, and the next compaction drops
+    // it from the postings. Returns false if `docID` is not indexed.
+    bool remove(const std::string& docID) {
+        wait_for_compaction();
+        tbb::spin_mutex::scoped_lock lock(mutex_for_signatures);
+        uint32_t id = documents.find(docID);
+        if (id == DocDictionary::NOT_FOUND || isRemoved(id)) {
+            return false;
+        }
+        markRemoved(id);
+        return true;
+    }
 
-            buckets[band][bandHash].push_back(docID);
+    bool contains(std::string_view docID) const {
+        uint32_t id = documents.find(docID);
+        return id != DocDictionary::NOT_FOUND && !isRemoved(id);
+    }
+
+    // Removes `removed` and inserts every term of `added` under its own text as the label, all
+    // into the delta segment, then freezes it. The base tables are left as they are until the
+    // next compaction.
+    void apply_delta(const std::vector<std::string>& added, const std::vector<std::string>& removed) {
+        for (const auto& docID : removed) {
+            remove(docID);
         }
+        tbb::parallel_for(size_t(0), added.size(), [&](size_t i) {
+            insert(std::string_view(added[i]), added[i]);
+        });
+        freeze();
     }
 
-    std::unordered_set<std::string> query(const std::vector<std::string>& queryNgrams, double threshold = 0.4) {
-        auto querySignature = minhash(queryNgrams, hashFuncs);
-        std::unordered_set<std::string> candidateDocs;
-        
-        tbb::parallel_for(0, numBands, [&](int band) {
-            int start = band * bandSize;
-            int end = (band + 1) * bandSize;
-            std::string bandHash = computeBandHash(querySignature, start, end);
-            
-            auto& bandBucket = buckets[band];
-            if (bandBucket.find(bandHash) != bandBucket.end()) {
-                tbb::spin_mutex::scoped_lock lock;
-                for (const auto& docID : bandBucket[bandHash]) {
-                    lock.acquire(mutex_for_candidateDocs);
-                    candidateDocs.insert(docID);
-                    lock.release();
+    // Brings the index in line with a new version of its source, each term indexed under its
+    // own text: labels no longer listed are removed and new ones are added, through
+    // apply_delta(). Returns the number of terms added plus removed.
+    size_t sync_terms(const std::vector<std::string>& terms) {
+        std::unordered_set<std::string_view> listed(terms.begin(), terms.end());
+        std::vector<std::string> removed;
+        for (uint32_t id = 0; id < documents.size(); ++id) {
+            if (!isRemoved(id) && !listed.count(documents.label(id))) {
+                removed.emplace_back(documents.label(id));
+            }
+        }
+
+        std::vector<std::string> added;
+        std::unordered_set<std::string_view> queued;
+        for (const auto& term : terms) {
+            if (!contains(term) && queued.insert(term).second) {
+                added.push_back(term);
+            }
+        }
+
+        apply_delta(added, removed);
+        return added.size() + removed.size();
+    }
+
+    // Folds the delta segment into the base tables and drops tombstoned IDs from the postings.
+    void compact() {
+        wait_for_compaction();
+        freeze();
+        mergeDelta();
+    }
+
+    // Runs compact() on a background thread. Queries keep being answered from the current
+    // tables and see the merged ones once they are swapped in; writers wait for it to finish.
+    void compact_async() {
+        wait_for_compaction();
+        freeze();
+        std::lock_guard<std::mutex> lock(mutex_for_compaction);
+        compaction = std::async(std::launch::async, [this] { mergeDelta(); }).share();
+    }
+
+    void wait_for_compaction() const {
+        std::shared_future<void> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex_for_compaction);
+            pending = compaction;
+        }
+        if (pending.valid()) {
+            pending.wait();
+        }
+    }
+
+    // Order-independent hash of a set of labels. The index keeps the same hash of its live labels
+    // up to date, so a source can be checked against a saved index without rebuilding it.
+    static uint64_t content_hash(const std::vector<std::string>& labels) {
+        std::vector<uint64_t> hashes;
+        hashes.reserve(labels.size());
+        for (const auto& label : labels) {
+            hashes.push_back(labelHash(label));
+        }
+        std::sort(hashes.begin(), hashes.end());
+        hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+
+        uint64_t h = 0;
+        for (uint64_t x : hashes) {
+            h += x;
+        }
+        return h;
+    }
+
+    uint64_t getContentHash() const { return contentHash; }
+
+    // 64-bit key of one band: its slots folded through the splitmix64 finalizer.
+    uint64_t computeBandHash(const std::vector<unsigned long>& signature, int band, int start, int end) const {
+        uint64_t h = static_cast<uint64_t>(band);
+        for (int i = start; i < end; ++i) {
+            h = mix64(h ^ signature[i]);
+        }
+        return h;
+    }
+
+    // Changes whenever the parameters or the set of indexed documents change (every insert,
+    // update or remove consumes or retires an ID), but not on compaction or reload.
+    uint64_t fingerprint() const {
+        uint64_t h = contentHash;
+        for (uint64_t value : {uint64_t(signatures.numSlots()), uint64_t(signatures.bitsPerSlot()),
+                               uint64_t(ngramSize), uint64_t(hasher.getScheme()), hasher.getSeed(),
+                               uint64_t(documents.size()), uint64_t(numRemoved)}) {
+            h = mix64(h ^ value);
+        }
+        for (const Banding& banding : bandings) {
+            uint64_t threshold;
+            std::memcpy(&threshold, &banding.threshold, sizeof(threshold));
+            h = mix64(h ^ (uint64_t(banding.bands) << 32 | uint64_t(banding.rows)));
+            h = mix64(h ^ threshold);
+        }
+        return h;
+    }
+
+    // Adds another banding of the same signatures, for queries at `threshold` or above (see
+    // tune_banding() in BandingTuner.h); each query probes only the banding whose threshold is
+    // the highest not above its own. Band keys are computed from the full min-hash values,
+    // which are not kept, so bandings can only be added to an empty index. Returns false,
+    // changing nothing, otherwise or if the banding needs more slots than the signatures have.
+    bool add_banding(int bands, int rows, double threshold) {
+        if (documents.size() != 0 || bands <= 0 || rows <= 0 || bands * rows > signatures.numSlots()) {
+            return false;
+        }
+        bandings.push_back(Banding{bands, rows, threshold, numTables});
+        numTables += bands;
+        buckets.resize(numTables);
+        delta.resize(numTables);
+        return true;
+    }
+
+    const std::vector<Banding>& getBandings() const { return bandings; }
+
+    // Indexes every term under its own text as the label, straight into the base tables, and
+    // leaves the index frozen; must not run concurrently with insert(). IDs are assigned up
+    // front so each term owns a row, signatures are computed in parallel straight into those
+    // rows, and every band's (key, ID) entries land in that band's own array at the term's
+    // position, so no thread contends with another. Each band is then sorted and laid out
+    // independently.
+    void bulk_build(const std::vector<std::string>& terms) {
+        wait_for_compaction();
+        std::lock_guard<std::mutex> lock(mutex_for_freeze);
+        std::vector<uint32_t> ids(terms.size());
+        {
+            tbb::spin_mutex::scoped_lock lock(mutex_for_signatures);
+            for (size_t i = 0; i < terms.size(); ++i) {
+                ids[i] = assignID(terms[i]);
+            }
+            signatures.resize(documents.size());
+        }
+
+        std::vector<std::vector<std::pair<uint64_t, uint32_t>>> entries(
+            numTables, std::vector<std::pair<uint64_t, uint32_t>>(terms.size()));
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, terms.size(), 64), [&](const tbb::blocked_range<size_t>& r) {
+            AlignedWords packed(signatures.wordsPerRow());
+            for (size_t i = r.begin(); i != r.end(); ++i) {
+                auto minhashSignature = signatureOf(terms[i]);
+                signatures.pack(minhashSignature, packed.data());
+                signatures.set(ids[i], packed.data());
+                for (const Banding& banding : bandings) {
+                    for (int band = 0; band < banding.bands; ++band) {
+                        entries[banding.firstTable + band][i] = {bandKey(minhashSignature, banding, band), ids[i]};
+                    }
                 }
             }
         });
 
-        tbb::concurrent_unordered_map<std::string, bool> filteredDocs;
-        
-        tbb::parallel_for_each(candidateDocs.begin(), candidateDocs.end(), [&](const std::string& docID) {
-            auto& docSignature = signatures.at(docID);
-            double similarity = jaccard_similarity(querySignature, docSignature);
-            if (similarity >= threshold) {
-                filteredDocs[docID] = true;
+        tbb::parallel_for(0, numTables, [&](int table) {
+            buckets[table].bulkLoad(std::move(entries[table]));
+            delta[table].freeze();
+        });
+        frozen.store(true, std::memory_order_release);
+    }
+
+    // Lays out the delta tables staged by insert() for lookups. query() freezes on demand,
+    // but calling this once after a build keeps the first queries from paying for it.
+    void freeze() {
+        std::lock_guard<std::mutex> lock(mutex_for_freeze);
+        if (frozen.load(std::memory_order_acquire)) {
+            return;
+        }
+        tbb::parallel_for(0, numTables, [&](int table) {
+            delta[table].freeze();
+        });
+        frozen.store(true, std::memory_order_release);
+    }
+
+    std::unordered_set<std::string> query(const std::vector<std::string>& queryNgrams, double threshold = 0.4) {
+        return query_signature(minhash(queryNgrams, hasher), threshold);
+    }
+
+    // With `probes` > 0 the query also probes that many perturbed band keys (multi-probe LSH,
+    // see perturbedKeys()), so fewer bands reach the same recall at the cost of more lookups.
+    std::unordered_set<std::string> query(std::string_view text, double threshold = 0.4, int probes = 0) {
+        if (probes <= 0) {
+            return query_signature(signatureOf(text), threshold);
+        }
+        std::vector<unsigned long> runnersUp;
+        auto querySignature = signatureOf(text, runnersUp);
+        return query_signature(querySignature, threshold, runnersUp, probes);
+    }
+
+    // `runnersUp` is only needed when `probes` > 0; see MinHasher::fromShinglesWithRunnersUp().
+    std::unordered_set<std::string> query_signature(const std::vector<unsigned long>& querySignature, double threshold = 0.4,
+                                                    const std::vector<unsigned long>& runnersUp = {}, int probes = 0) {
+        if (!frozen.load(std::memory_order_acquire)) {
+            freeze();
+        }
+        AlignedWords packedQuery = signatures.pack(querySignature);
+        std::shared_lock<std::shared_mutex> segmentsLock(mutex_for_segments);
+
+        // Merge the postings of every band the query hits into one duplicate-free ID list.
+        QueryStats stats;
+        stats.queries = 1;
+        const Banding& banding = bandingFor(threshold);
+        std::vector<uint32_t> candidateDocs;
+        for (int band = 0; band < banding.bands; ++band) {
+            size_t before = candidateDocs.size();
+            appendHits(banding.firstTable + band, bandKey(querySignature, banding, band), candidateDocs);
+            stats.bandHits += candidateDocs.size() != before;
+        }
+        std::vector<std::pair<int, uint64_t>> extraProbes;
+        perturbedKeys(querySignature, runnersUp, banding, probes, extraProbes);
+        for (const auto& [table, key] : extraProbes) {
+            size_t before = candidateDocs.size();
+            appendHits(table, key, candidateDocs);
+            stats.bandHits += candidateDocs.size() != before;
+        }
+        std::sort(candidateDocs.begin(), candidateDocs.end());
+        candidateDocs.erase(std::unique(candidateDocs.begin(), candidateDocs.end()), candidateDocs.end());
+
+        size_t minMatches = signatures.requiredMatches(threshold);
+        std::vector<char> accepted(candidateDocs.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, candidateDocs.size(), 256), [&](const tbb::blocked_range<size_t>& r) {
+            for (size_t i = r.begin(); i != r.end(); ++i) {
+                accepted[i] = signatures.matches(packedQuery.data(), signatures.row(candidateDocs[i])) >= minMatches;
             }
         });
 
         std::unordered_set<std::string> result;
-        // Convert concurrent map to set
-        for (auto& item : filteredDocs) {
-            result.insert(item.first);
+        for (size_t i = 0; i < candidateDocs.size(); ++i) {
+            if (accepted[i]) {
+                result.emplace(documents.label(candidateDocs[i]));
+            }
         }
+        stats.candidates = candidateDocs.size();
+        stats.matches = result.size();
+        recordQueries(stats);
         return result;
     }
 
-    void save_to_disk(const std::string& filename) const {
-        std::ofstream outFile(filename, std::ios::binary);
+    // Returns up to k documents whose estimated similarity is at least minThreshold, best first.
+    // Candidates are visited in decreasing number of colliding bands. A candidate colliding in h
+    // bands agrees on at most h * r + (b - h) * (r - 1) of the banded min-hash slots (plus any
+    // slots outside the bands), so once that bound falls below the k-th best estimate in the
+    // heap, no remaining candidate can enter the top k and the scan stops. The bound counts
+    // full min-hash agreements; accidental b-bit collisions (probability 2^-b per slot) can
+    // exceed it, which only matters for very narrow signatures.
+    std::vector<std::pair<std::string, double>> query_topk(const std::vector<std::string>& queryNgrams, size_t k,
+                                                           double minThreshold = 0.0) {
+        return query_topk_signature(minhash(queryNgrams, hasher), k, minThreshold);
+    }
 
-        if (!outFile.is_open()) {
-            std::cerr << "Failed to open file: " << filename << std::endl;
-            return;
+    std::vector<std::pair<std::string, double>> query_topk(std::string_view text, size_t k, double minThreshold = 0.0,
+                                                           int probes = 0) {
+        if (probes <= 0) {
+            return query_topk_signature(signatureOf(text), k, minThreshold);
         }
+        std::vector<unsigned long> runnersUp;
+        auto querySignature = signatureOf(text, runnersUp);
+        return query_topk_signature(querySignature, k, minThreshold, runnersUp, probes);
+    }
 
-        // Serialize number of bands and band size
-        outFile.write(reinterpret_cast<const char*>(&numBands), sizeof(numBands));
-        outFile.write(reinterpret_cast<const char*>(&bandSize), sizeof(bandSize));
-
-        // Serialize buckets
-        for (int i = 0; i < numBands; ++i) {
-            auto& bandBucket = buckets[i];
-            size_t bucketSize = bandBucket.size();
-            outFile.write(reinterpret_cast<const char*>(&bucketSize), sizeof(bucketSize));
-            
-            for (const auto& [key, value] : bandBucket) {
-                size_t keySize = key.size();
-                outFile.write(reinterpret_cast<const char*>(&keySize), sizeof(keySize));
-                outFile.write(key.c_str(), keySize);
-
-                size_t valueSize = value.size();
-                outFile.write(reinterpret_cast<const char*>(&valueSize), sizeof(valueSize));
-                for (const auto& docID : value) {
-                    size_t docIDSize = docID.size();
-                    outFile.write(reinterpret_cast<const char*>(&docIDSize), sizeof(docIDSize));
-                    outFile.write(docID.c_str(), docIDSize);
-                }
-            }
+    // Candidates found only through perturbed probes collide in no band, so they are ranked
+    // with h = 0 and do not loosen the bound.
+    std::vector<std::pair<std::string, double>> query_topk_signature(const std::vector<unsigned long>& querySignature,
+                                                                     size_t k, double minThreshold = 0.0,
+                                                                     const std::vector<unsigned long>& runnersUp = {},
+                                                                     int probes = 0) {
+        if (!frozen.load(std::memory_order_acquire)) {
+            freeze();
+        }
+        std::vector<std::pair<std::string, double>> result;
+        if (k == 0) {
+            return result;
         }
 
-        // Serialize signatures
-        size_t sigSize = signatures.size();
-        outFile.write(reinterpret_cast<const char*>(&sigSize), sizeof(sigSize));
-
-        for (const auto& [docID, signature] : signatures) {
-            size_t docIDSize = docID.size();
-            outFile.write(reinterpret_cast<const char*>(&docIDSize), sizeof(docIDSize));
-            outFile.write(docID.c_str(), docIDSize);
+        AlignedWords packedQuery = signatures.pack(querySignature);
+        std::shared_lock<std::shared_mutex> segmentsLock(mutex_for_segments);
 
-            size_t sigVecSize = signature.size();
-            outFile.write(reinterpret_cast<const char*>(&sigVecSize), sizeof(sigVecSize));
-            outFile.write(reinterpret_cast<const char*>(signature.data()), sigVecSize * sizeof(unsigned long));
+        QueryStats stats;
+        stats.queries = 1;
+        const Banding& banding = bandingFor(minThreshold);
+        const int numBands = banding.bands;
+        const int bandSize = banding.rows;
+        std::vector<uint32_t> hits;
+        for (int band = 0; band < numBands; ++band) {
+            size_t before = hits.size();
+            appendHits(banding.firstTable + band, bandKey(querySignature, banding, band), hits);
+            stats.bandHits += hits.size() != before;
+        }
+        std::sort(hits.begin(), hits.end());
+
+        std::vector<uint32_t> probed;
+        std::vector<std::pair<int, uint64_t>> extraProbes;
+        perturbedKeys(querySignature, runnersUp, banding, probes, extraProbes);
+        for (const auto& [table, key] : extraProbes) {
+            size_t before = probed.size();
+            appendHits(table, key, probed);
+            stats.bandHits += probed.size() != before;
+        }
+        std::sort(probed.begin(), probed.end());
+        probed.erase(std::unique(probed.begin(), probed.end()), probed.end());
+
+        // Group candidates by their number of colliding bands, most collisions first.
+        std::vector<std::vector<uint32_t>> byHits(numBands + 1);
+        for (size_t i = 0; i < hits.size();) {
+            size_t j = i;
+            while (j < hits.size() && hits[j] == hits[i]) {
+                ++j;
+            }
+            byHits[j - i].push_back(hits[i]);
+            i = j;
+        }
+        std::set_difference(probed.begin(), probed.end(), hits.begin(), hits.end(), std::back_inserter(byHits[0]));
+
+        using Scored = std::pair<double, uint32_t>;
+        auto better = [](const Scored& a, const Scored& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        };
+        // Min-heap on `better`: the top is the weakest of the current best k.
+        std::vector<Scored> heap;
+        const size_t minMatches = signatures.requiredMatches(minThreshold);
+        const int unbandedSlots = signatures.numSlots() - numBands * bandSize;
+        for (int h = numBands; h >= 0; --h) {
+            size_t maxMatches = h * bandSize + (numBands - h) * (bandSize - 1) + unbandedSlots;
+            if (maxMatches < minMatches || (heap.size() == k && signatures.estimate(maxMatches) < heap.front().first)) {
+                break;
+            }
+            stats.candidates += byHits[h].size();
+            for (uint32_t docID : byHits[h]) {
+                size_t matches = signatures.matches(packedQuery.data(), signatures.row(docID));
+                if (matches < minMatches) {
+                    continue;
+                }
+                ++stats.matches;
+                Scored candidate{signatures.estimate(matches), docID};
+                if (heap.size() < k) {
+                    heap.push_back(candidate);
+                    std::push_heap(heap.begin(), heap.end(), better);
+                }
+                else if (better(candidate, heap.front())) {
+                    std::pop_heap(heap.begin(), heap.end(), better);
+                    heap.back() = candidate;
+                    std::push_heap(heap.begin(), heap.end(), better);
+                }
+            }
         }
 
-        outFile.close();
+        recordQueries(stats);
+        std::sort_heap(heap.begin(), heap.end(), better);
+        result.reserve(heap.size());
+        for (const auto& [similarity, docID] : heap) {
+            result.emplace_back(std::string(documents.label(docID)), similarity);
+        }
+        return result;
     }
 
-    // Load the LSH data from a file
-    void load_from_disk(const std::string& filename) {
-        std::ifstream inFile(filename, std::ios::binary);
+    // Answers a batch of query texts, each shingled with the index's n-gram size and filtered at
+    // its own threshold. Returns the matching document IDs of every query in ascending order.
+    // Signatures and band keys for the whole batch are computed in one parallel pass; probes are
+    // then issued per block of queries in (band, key) order, and candidates are deduplicated with
+    // a per-thread bitset over document IDs instead of a shared, locked set.
+    // `probes` perturbed band keys are added to every query, as in query().
+    std::vector<std::vector<uint32_t>> query_batch(const std::vector<std::string>& queries,
+                                                   const std::vector<double>& thresholds, int probes = 0) {
+        assert(queries.size() == thresholds.size());
+        if (!frozen.load(std::memory_order_acquire)) {
+            freeze();
+        }
 
-        if (!inFile.is_open()) {
-            std::cerr << "Failed to open file: " << filename << std::endl;
-            return;
+        const size_t numQueries = queries.size();
+        const size_t rowWords = signatures.wordsPerRow();
+        AlignedWords packedQueries(numQueries * rowWords);
+        // Every query probes the banding chosen for its threshold plus up to `probes` perturbed
+        // keys; keys are laid out `numProbes` per query, enough for the widest banding.
+        std::vector<const Banding*> queryBandings(numQueries);
+        int numProbes = 0;
+        for (size_t q = 0; q < numQueries; ++q) {
+            queryBandings[q] = &bandingFor(thresholds[q]);
+            numProbes = std::max(numProbes, queryBandings[q]->bands + std::max(probes, 0));
         }
+        // A table of -1 marks an unused probe slot.
+        std::vector<std::pair<int, uint64_t>> probeKeys(numQueries * numProbes, {-1, 0});
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, numQueries, 64), [&](const tbb::blocked_range<size_t>& r) {
+            std::vector<unsigned long> runnersUp;
+            std::vector<std::pair<int, uint64_t>> extraProbes;
+            for (size_t q = r.begin(); q != r.end(); ++q) {
+                const Banding& banding = *queryBandings[q];
+                auto querySignature = probes > 0 ? signatureOf(queries[q], runnersUp) : signatureOf(queries[q]);
+                signatures.pack(querySignature, &packedQueries[q * rowWords]);
+                auto* keys = &probeKeys[q * numProbes];
+                for (int band = 0; band < banding.bands; ++band) {
+                    keys[band] = {banding.firstTable + band, bandKey(querySignature, banding, band)};
+                }
+                extraProbes.clear();
+                perturbedKeys(querySignature, runnersUp, banding, probes, extraProbes);
+                std::copy(extraProbes.begin(), extraProbes.end(), keys + banding.bands);
+            }
+        });
 
-        // Deserialize number of bands and band size
-        inFile.read(reinterpret_cast<char*>(&numBands), sizeof(numBands));
-        inFile.read(reinterpret_cast<char*>(&bandSize), sizeof(bandSize));
-
-        // Deserialize buckets
-        buckets.resize(numBands);
-        for (int i = 0; i < numBands; ++i) {
-            size_t bucketSize;
-            inFile.read(reinterpret_cast<char*>(&bucketSize), sizeof(bucketSize));
-
-            for (size_t j = 0; j < bucketSize; ++j) {
-                size_t keySize;
-                inFile.read(reinterpret_cast<char*>(&keySize), sizeof(keySize));
-                std::string key(keySize, '\0');
-                inFile.read(&key[0], keySize);
-
-                size_t valueSize;
-                inFile.read(reinterpret_cast<char*>(&valueSize), sizeof(valueSize));
-                tbb::concurrent_vector<std::string> value(valueSize);
-
-                for (size_t k = 0; k < valueSize; ++k) {
-                    size_t docIDSize;
-                    inFile.read(reinterpret_cast<char*>(&docIDSize), sizeof(docIDSize));
-                    std::string docID(docIDSize, '\0');
-                    inFile.read(&docID[0], docIDSize);
-                    value[k] = docID;
+        struct Probe {
+            uint32_t table;
+            uint32_t query;
+            uint32_t slot;
+            uint64_t key;
+        };
+        // Small enough that a single consumer batch still splits across every worker.
+        const size_t blockSize = 256;
+        const size_t numWords = (documents.size() + 63) / 64;
+        tbb::enumerable_thread_specific<std::vector<uint64_t>> seenDocs([numWords] { return std::vector<uint64_t>(numWords); });
+        std::vector<std::vector<uint32_t>> results(numQueries);
+        std::shared_lock<std::shared_mutex> segmentsLock(mutex_for_segments);
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, numQueries, blockSize), [&](const tbb::blocked_range<size_t>& r) {
+            const size_t first = r.begin();
+            std::vector<Probe> lookups;
+            lookups.reserve(r.size() * numProbes);
+            for (size_t q = r.begin(); q != r.end(); ++q) {
+                for (int slot = 0; slot < numProbes; ++slot) {
+                    const auto& [table, key] = probeKeys[q * numProbes + slot];
+                    if (table >= 0) {
+                        lookups.push_back(Probe{static_cast<uint32_t>(table), static_cast<uint32_t>(q),
+                                                static_cast<uint32_t>(slot), key});
+                    }
+                }
+            }
+            std::sort(lookups.begin(), lookups.end(), [](const Probe& a, const Probe& b) {
+                return a.table != b.table ? a.table < b.table : a.key < b.key;
+            });
+
+            // Equal (table, key) pairs are adjacent after sorting, so repeated keys cost one lookup.
+            // Each probe has a base and a delta hit; unused probe slots stay empty.
+            QueryStats stats;
+            stats.queries = r.size();
+            std::vector<Postings> hits(r.size() * numProbes * 2);
+            Postings bucket, deltaBucket;
+            for (size_t i = 0; i < lookups.size(); ++i) {
+                const Probe& probe = lookups[i];
+                if (i == 0 || probe.table != lookups[i - 1].table || probe.key != lookups[i - 1].key) {
+                    bucket = buckets[probe.table].find(probe.key);
+                    deltaBucket = delta[probe.table].find(probe.key);
                 }
+                size_t slot = ((probe.query - first) * numProbes + probe.slot) * 2;
+                hits[slot] = bucket;
+                hits[slot + 1] = deltaBucket;
+                stats.bandHits += !bucket.empty() || !deltaBucket.empty();
+            }
 
-                buckets[i][key] = value;
+            std::vector<uint64_t>& seen = seenDocs.local();
+            std::vector<uint32_t> candidates;
+            for (size_t q = r.begin(); q != r.end(); ++q) {
+                candidates.clear();
+                for (size_t slot = (q - first) * numProbes * 2; slot < (q - first + 1) * numProbes * 2; ++slot) {
+                    for (uint32_t docID : hits[slot]) {
+                        uint64_t bit = uint64_t(1) << (docID & 63);
+                        if (!(seen[docID >> 6] & bit) && !isRemoved(docID)) {
+                            seen[docID >> 6] |= bit;
+                            candidates.push_back(docID);
+                        }
+                    }
+                }
+
+                size_t minMatches = signatures.requiredMatches(thresholds[q]);
+                const uint64_t* packedQuery = &packedQueries[q * rowWords];
+                auto& result = results[q];
+                for (uint32_t docID : candidates) {
+                    seen[docID >> 6] = 0;
+                    if (signatures.matches(packedQuery, signatures.row(docID)) >= minMatches) {
+                        result.push_back(docID);
+                    }
+                }
+                std::sort(result.begin(), result.end());
+                stats.candidates += candidates.size();
+                stats.matches += result.size();
             }
+            recordQueries(stats);
+        });
+
+        return results;
+    }
+
+    // Work done by the queries answered so far, summed over threads. Read it while no query is
+    // running; the per-thread counters are not synchronized.
+    struct QueryStats {
+        uint64_t queries = 0;
+        uint64_t bandHits = 0;   // band probes that found a non-empty bucket
+        uint64_t candidates = 0; // distinct live documents compared against the query signature
+        uint64_t matches = 0;    // candidates that passed the threshold
+    };
+
+    QueryStats query_stats() const {
+        QueryStats total;
+        for (const QueryStats& local : queryStats) {
+            total.queries += local.queries;
+            total.bandHits += local.bandHits;
+            total.candidates += local.candidates;
+            total.matches += local.matches;
         }
+        return total;
+    }
 
-        // Deserialize signatures
-        size_t sigSize;
-        inFile.read(reinterpret_cast<char*>(&sigSize), sizeof(sigSize));
+    // Number of indexed (not removed) documents.
+    size_t size() const { return documents.size() - numRemoved; }
+
+    std::string_view docLabel(uint32_t id) const { return documents.label(id); }
+
+    int getNgramSize() const { return ngramSize; }
+
+    // Writes the index in the mappable format described in IndexFile.h.
+    bool save_to_disk(const std::string& filename) {
+        freeze();
+        std::shared_lock<std::shared_mutex> segmentsLock(mutex_for_segments);
+
+        IndexHeader header{};
+        header.numHashes = signatures.numSlots();
+        header.numBands = bandings[0].bands;
+        header.bandSize = bandings[0].rows;
+        header.signatureBits = signatures.bitsPerSlot();
+        header.ngramSize = ngramSize;
+        header.scheme = static_cast<uint32_t>(hasher.getScheme());
+        header.seed = hasher.getSeed();
+        header.numDocs = documents.size();
+        header.contentHash = contentHash;
+
+        IndexWriter writer;
+        const auto& arena = documents.arenaData();
+        const auto& offsets = documents.offsetData();
+        const auto& dictSlots = documents.slotData();
+        writer.add(SectionKind::DictArena, 0, arena.data(), arena.size());
+        writer.add(SectionKind::DictOffsets, 0, offsets.data(), offsets.size() * sizeof(uint64_t));
+        writer.add(SectionKind::DictSlots, 0, dictSlots.data(), dictSlots.size() * sizeof(DocDictionary::Slot));
+        writer.add(SectionKind::Signatures, 0, signatures.rowData(),
+                   signatures.rows() * signatures.wordsPerRow() * sizeof(uint64_t));
+        for (int table = 0; table < numTables; ++table) {
+            const auto& slots = buckets[table].slotData();
+            const auto& postings = buckets[table].postingData();
+            writer.add(SectionKind::BucketSlots, table, slots.data(), slots.size() * sizeof(BucketTable::Slot));
+            writer.add(SectionKind::BucketPostings, table, postings.data(), postings.size() * sizeof(uint32_t));
+            const auto& deltaSlots = delta[table].slotData();
+            const auto& deltaPostings = delta[table].postingData();
+            writer.add(SectionKind::DeltaSlots, table, deltaSlots.data(), deltaSlots.size() * sizeof(BucketTable::Slot));
+            writer.add(SectionKind::DeltaPostings, table, deltaPostings.data(), deltaPostings.size() * sizeof(uint32_t));
+        }
+        writer.add(SectionKind::Tombstones, 0, tombstones.data(), tombstones.size() * sizeof(uint64_t));
+        std::vector<BandingRecord> records;
+        for (const Banding& banding : bandings) {
+            records.push_back(BandingRecord{uint32_t(banding.bands), uint32_t(banding.rows), banding.threshold});
+        }
+        writer.add(SectionKind::Bandings, 0, records.data(), records.size() * sizeof(BandingRecord));
+        return writer.write(filename, header);
+    }
 
-        for (size_t i = 0; i < sigSize; ++i) {
-            size_t docIDSize;
-            inFile.read(reinterpret_cast<char*>(&docIDSize), sizeof(docIDSize));
-            std::string docID(docIDSize, '\0');
-            inFile.read(&docID[0], docIDSize);
+    // Maps an index written by save_to_disk() and serves queries straight from the mapping.
+    // The file's parameters replace the ones this LSH was constructed with, unless
+    // `requireSameParameters` is set, in which case a file built with different parameters is
+    // rejected as stale. Returns false, leaving the index untouched, if the file is missing,
+    // malformed, corrupt or rejected. Every table is bounds-checked, which reads only the small
+    // slot tables; `verifyChecksum` also hashes the whole file and checks every posting, so the
+    // load is no longer proportional to what the queries touch.
+    bool load_from_disk(const std::string& filename, bool verifyChecksum = false, bool requireSameParameters = false) {
+        wait_for_compaction();
+        IndexReader reader;
+        if (!reader.open(filename, verifyChecksum)) {
+            return false;
+        }
+        const IndexHeader& header = reader.getHeader();
+
+        int bits = header.signatureBits;
+        if (header.numBands == 0 || header.numHashes < uint64_t(header.numBands) * header.bandSize ||
+            (bits != 1 && bits != 2 && bits != 4 && bits != 8 && bits != 16) || header.ngramSize == 0 ||
+            header.scheme > static_cast<uint32_t>(MinHashScheme::OnePermutation)) {
+            std::cerr << "Index file " << filename << " has invalid parameters" << std::endl;
+            return false;
+        }
 
-            size_t sigVecSize;
-            inFile.read(reinterpret_cast<char*>(&sigVecSize), sizeof(sigVecSize));
-            std::vector<unsigned long> signature(sigVecSize);
-            inFile.read(reinterpret_cast<char*>(signature.data()), sigVecSize * sizeof(unsigned long));
+        // The file's bandings: the primary one from the header, then any extra ones.
+        size_t numRecords;
+        const BandingRecord* records = reader.section<BandingRecord>(SectionKind::Bandings, 0, numRecords);
+        std::vector<Banding> loadedBandings{primaryBanding(header.numBands, header.bandSize)};
+        bool validBandings = !records || (numRecords >= 1 && records[0].bands == header.numBands &&
+                                          records[0].rows == header.bandSize);
+        int loadedTables = header.numBands;
+        for (size_t i = 1; validBandings && i < numRecords; ++i) {
+            validBandings = records[i].bands != 0 && records[i].rows != 0 &&
+                            uint64_t(records[i].bands) * records[i].rows <= header.numHashes;
+            loadedBandings.push_back(Banding{int(records[i].bands), int(records[i].rows), records[i].threshold, loadedTables});
+            loadedTables += records[i].bands;
+        }
+        if (!validBandings) {
+            std::cerr << "Index file " << filename << " has invalid bandings" << std::endl;
+            return false;
+        }
 
-            signatures[docID] = signature;
+        if (requireSameParameters &&
+            (!sameBandings(loadedBandings, bandings) ||
+             header.numHashes != static_cast<uint32_t>(signatures.numSlots()) || header.signatureBits != static_cast<uint32_t>(signatures.bitsPerSlot()) ||
+             header.ngramSize != static_cast<uint32_t>(ngramSize) || header.scheme != static_cast<uint32_t>(hasher.getScheme()) ||
+             header.seed != hasher.getSeed())) {
+            std::cerr << "Index file " << filename << " was built with different parameters" << std::endl;
+            return false;
+        }
+        SignatureMatrix loadedSignatures(header.numHashes, bits);
+
+        size_t arenaSize, numOffsets, numDictSlots, numWords;
+        const char* arena = reader.section<char>(SectionKind::DictArena, 0, arenaSize);
+        const uint64_t* offsets = reader.section<uint64_t>(SectionKind::DictOffsets, 0, numOffsets);
+        const auto* dictSlots = reader.section<DocDictionary::Slot>(SectionKind::DictSlots, 0, numDictSlots);
+        const uint64_t* rows = reader.section<uint64_t>(SectionKind::Signatures, 0, numWords);
+        size_t numTombstoneWords;
+        const uint64_t* removedBits = reader.section<uint64_t>(SectionKind::Tombstones, 0, numTombstoneWords);
+        bool valid = arena && offsets && dictSlots && rows && removedBits && numOffsets == header.numDocs + 1 &&
+                     isPowerOfTwo(numDictSlots) && numWords == header.numDocs * loadedSignatures.wordsPerRow() &&
+                     numTombstoneWords == (header.numDocs + 63) / 64 &&
+                     validDictionary(arenaSize, offsets, numOffsets, dictSlots, numDictSlots);
+
+        std::vector<BucketTable> loadedBuckets(loadedTables);
+        std::vector<BucketTable> loadedDelta(loadedTables);
+        for (int table = 0; valid && table < loadedTables; ++table) {
+            valid = attachBand(reader, SectionKind::BucketSlots, SectionKind::BucketPostings, table, header.numDocs,
+                               verifyChecksum, loadedBuckets[table]) &&
+                    attachBand(reader, SectionKind::DeltaSlots, SectionKind::DeltaPostings, table, header.numDocs,
+                               verifyChecksum, loadedDelta[table]);
+        }
+        if (!valid) {
+            std::cerr << "Index file " << filename << " has missing or inconsistent sections" << std::endl;
+            return false;
         }
 
-        inFile.close();
+        bandings = std::move(loadedBandings);
+        numTables = loadedTables;
+        ngramSize = header.ngramSize;
+        hasher = MinHasher(header.numHashes, static_cast<MinHashScheme>(header.scheme), header.seed);
+        signatures = std::move(loadedSignatures);
+        signatures.attach(rows, header.numDocs);
+        documents.attach(arena, arenaSize, offsets, numOffsets, dictSlots, numDictSlots);
+        buckets = std::move(loadedBuckets);
+        delta = std::move(loadedDelta);
+        tombstones.attach(removedBits, numTombstoneWords);
+        numRemoved = 0;
+        for (uint64_t word : tombstones) {
+            numRemoved += __builtin_popcountll(word);
+        }
+        contentHash = header.contentHash;
+        mapping = reader.mapping();
+        frozen.store(true, std::memory_order_release);
+        return true;
     }
 
 private:
-    int numBands;
-    int bandSize;
-    std::vector<HashFunc> hashFuncs;
-    tbb::concurrent_vector<tbb::concurrent_unordered_map<std::string, tbb::concurrent_vector<std::string>>> buckets;
-    tbb::concurrent_unordered_map<std::string, std::vector<unsigned long>> signatures;
-    tbb::spin_mutex mutex_for_candidateDocs;
-
-    std::string computeBandHash(const std::vector<unsigned long>& signature, int start, int end) {
-        std::ostringstream oss;
-        for (int i = start; i < end; ++i) {
-            oss << signature[i];
+    int ngramSize;
+    MinHasher hasher;
+    SignatureMatrix signatures;
+    // bandings[0] is the one given to the constructor; add_banding() appends more.
+    std::vector<Banding> bandings;
+    int numTables;
+    // Base tables, built in bulk or by compaction, and the delta segment that insert() feeds,
+    // one of each per band of every banding.
+    std::vector<BucketTable> buckets;
+    std::vector<BucketTable> delta;
+    DocDictionary documents;
+    // One bit per ID; a removed or replaced document keeps its ID, row and postings until the
+    // next compaction drops the postings.
+    ArrayStorage<uint64_t> tombstones;
+    size_t numRemoved = 0;
+    // Sum of labelHash() over the live labels, maintained as documents come and go.
+    uint64_t contentHash = 0;
+    tbb::spin_mutex mutex_for_signatures;
+    std::mutex mutex_for_freeze;
+    std::atomic<bool> frozen{false};
+    // Queries hold it shared; compaction takes it exclusively only to swap in merged tables.
+    mutable std::shared_mutex mutex_for_segments;
+    mutable std::mutex mutex_for_compaction;
+    std::shared_future<void> compaction;
+    std::shared_ptr<MappedFile> mapping;
+    tbb::enumerable_thread_specific<QueryStats> queryStats;
+
+    void recordQueries(const QueryStats& stats) {
+        QueryStats& local = queryStats.local();
+        local.queries += stats.queries;
+        local.bandHits += stats.bandHits;
+        local.candidates += stats.candidates;
+        local.matches += stats.matches;
+    }
+
+    // Signature of `text` shingled into character n-grams, hashed straight from the input.
+    std::vector<unsigned long> signatureOf(std::string_view text) const {
+        return hasher.fromShingles([&](auto&& add) {
+            for_each_shingle(text, ngramSize, ShingleUnit::Char, [&](std::string_view shingle) {
+                add(hasher.shingleHash(shingle));
+            });
+        });
+    }
+
+    std::vector<unsigned long> signatureOf(std::string_view text, std::vector<unsigned long>& runnersUp) const {
+        return hasher.fromShinglesWithRunnersUp([&](auto&& add) {
+            for_each_shingle(text, ngramSize, ShingleUnit::Char, [&](std::string_view shingle) {
+                add(hasher.shingleHash(shingle));
+            });
+        }, runnersUp);
+    }
+
+    static uint64_t labelHash(std::string_view label) {
+        return mix64(hash_bytes(label.data(), label.size(), 0x2545F4914F6CDD1DULL));
+    }
+
+    bool isRemoved(uint32_t id) const {
+        return numRemoved != 0 && (tombstones[id >> 6] >> (id & 63) & 1);
+    }
+
+    // Callers hold mutex_for_signatures.
+    void markRemoved(uint32_t id) {
+        tombstones.mutableVector()[id >> 6] |= uint64_t(1) << (id & 63);
+        ++numRemoved;
+        contentHash -= labelHash(documents.label(id));
+    }
+
+    // Returns a fresh ID for `label`, tombstoning the ID it had. The caller holds
+    // mutex_for_signatures and adds the signature row for the new ID.
+    uint32_t assignID(std::string_view label) {
+        uint32_t old = documents.find(label);
+        uint32_t id;
+        if (old == DocDictionary::NOT_FOUND) {
+            id = documents.intern(label);
+        }
+        else {
+            if (!isRemoved(old)) {
+                markRemoved(old);
+            }
+            id = documents.reassign(label);
         }
-        std::string combined = oss.str();
+        tombstones.mutableVector().resize((documents.size() + 63) / 64);
+        contentHash += labelHash(label);
+        return id;
+    }
+
+    // The banding sized for queries at `threshold`: the one with the highest threshold not
+    // above it, or the one with the lowest threshold if all are above it.
+    const Banding& bandingFor(double threshold) const {
+        const Banding* chosen = nullptr;
+        const Banding* lowest = &bandings[0];
+        for (const Banding& banding : bandings) {
+            if (banding.threshold <= threshold + 1e-9 && (!chosen || banding.threshold > chosen->threshold)) {
+                chosen = &banding;
+            }
+            if (banding.threshold < lowest->threshold) {
+                lowest = &banding;
+            }
+        }
+        return chosen ? *chosen : *lowest;
+    }
+
+    // The constructor's banding, sized for the point where its S-curve is steepest.
+    static Banding primaryBanding(int bands, int rows) {
+        return Banding{bands, rows, std::pow(1.0 / bands, 1.0 / rows), 0};
+    }
+
+    static bool sameBandings(const std::vector<Banding>& a, const std::vector<Banding>& b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); ++i) {
+            if (a[i].bands != b[i].bands || a[i].rows != b[i].rows || a[i].threshold != b[i].threshold) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Key of band `band` of `banding`, seeded with its table number so bandings never share keys.
+    uint64_t bandKey(const std::vector<unsigned long>& signature, const Banding& banding, int band) const {
+        return computeBandHash(signature, banding.firstTable + band, band * banding.rows, (band + 1) * banding.rows);
+    }
+
+    // Multi-probe LSH (Lv et al., 2007) adapted to min-hash: besides its exact band keys, a query
+    // probes up to `probes` keys of `banding` in which one slot holds its runner-up value instead
+    // of the minimum. A document that lacks the query's minimal shingle in that slot most likely
+    // has the runner-up as its minimum there, and the smaller the runner-up, the likelier that
+    // is, so the slots with the smallest runners-up are probed first. Appends (table, key) pairs.
+    void perturbedKeys(const std::vector<unsigned long>& signature, const std::vector<unsigned long>& runnersUp,
+                       const Banding& banding, int probes, std::vector<std::pair<int, uint64_t>>& out) const {
+        if (probes <= 0 || runnersUp.size() != signature.size()) {
+            return;
+        }
+        std::vector<int> slots;
+        for (int slot = 0; slot < banding.bands * banding.rows; ++slot) {
+            if (runnersUp[slot] != ULONG_MAX) {
+                slots.push_back(slot);
+            }
+        }
+        size_t count = std::min<size_t>(probes, slots.size());
+        std::partial_sort(slots.begin(), slots.begin() + count, slots.end(),
+                          [&](int a, int b) { return runnersUp[a] < runnersUp[b]; });
+
+        std::vector<unsigned long> perturbed = signature;
+        for (size_t i = 0; i < count; ++i) {
+            int slot = slots[i];
+            int band = slot / banding.rows;
+            perturbed[slot] = runnersUp[slot];
+            out.emplace_back(banding.firstTable + band, bandKey(perturbed, banding, band));
+            perturbed[slot] = signature[slot];
+        }
+    }
 
-        unsigned char hash[SHA_DIGEST_LENGTH];
-        SHA1(reinterpret_cast<const unsigned char*>(combined.c_str()), combined.size(), hash);
+    // Appends the live IDs stored under `key` in the base and delta tables of table `band`.
+    void appendHits(int band, uint64_t key, std::vector<uint32_t>& out) const {
+        for (const BucketTable* table : {&buckets[band], &delta[band]}) {
+            for (uint32_t docID : table->find(key)) {
+                if (!isRemoved(docID)) {
+                    out.push_back(docID);
+                }
+            }
+        }
+    }
+
+    // Merges the frozen delta into the base tables, leaving out tombstoned IDs, and swaps the
+    // result in. The merge reads the current tables while queries keep using them.
+    void mergeDelta() {
+        std::vector<BucketTable> merged(numTables);
+        tbb::parallel_for(0, numTables, [&](int band) {
+            std::vector<std::pair<uint64_t, uint32_t>> entries;
+            entries.reserve(buckets[band].numPostings() + delta[band].numPostings());
+            auto collect = [&](uint64_t key, Postings bucket) {
+                for (uint32_t docID : bucket) {
+                    if (!isRemoved(docID)) {
+                        entries.emplace_back(key, docID);
+                    }
+                }
+            };
+            buckets[band].forEach(collect);
+            delta[band].forEach(collect);
+            merged[band].bulkLoad(std::move(entries));
+        });
+
+        std::unique_lock<std::shared_mutex> lock(mutex_for_segments);
+        buckets = std::move(merged);
+        delta = std::vector<BucketTable>(numTables);
+    }
+
+    // Attaches one band's tables once every bucket lies inside the postings and probing has an
+    // empty slot to stop at. With `checkPostings`, every posting must also name one of `numDocs`
+    // documents; that reads all postings, so it is left to verified loads.
+    static bool attachBand(const IndexReader& reader, SectionKind slotKind, SectionKind postingKind, uint32_t band,
+                           uint64_t numDocs, bool checkPostings, BucketTable& table) {
+        size_t numSlots, numPostings;
+        const auto* slots = reader.section<BucketTable::Slot>(slotKind, band, numSlots);
+        const uint32_t* postings = reader.section<uint32_t>(postingKind, band, numPostings);
+        if (!slots || !postings || (numSlots != 0 && !isPowerOfTwo(numSlots))) {
+            return false;
+        }
+        bool hasEmpty = numSlots == 0;
+        for (size_t i = 0; i < numSlots; ++i) {
+            hasEmpty |= slots[i].count == 0;
+            if (uint64_t(slots[i].begin) + slots[i].count > numPostings) {
+                return false;
+            }
+        }
+        if (!hasEmpty) {
+            return false;
+        }
+        if (checkPostings) {
+            uint32_t maxID = 0;
+            for (size_t i = 0; i < numPostings; ++i) {
+                maxID = std::max(maxID, postings[i]);
+            }
+            if (numPostings != 0 && maxID >= numDocs) {
+                return false;
+            }
+        }
+        table.attach(slots, numSlots, postings, numPostings);
+        return true;
+    }
 
-        std::ostringstream result;
-        for (int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
-            result << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+    // Checks the mapped dictionary the same way: labels inside the arena, slot IDs naming
+    // documents, and at least one empty slot.
+    static bool validDictionary(size_t arenaSize, const uint64_t* offsets, size_t numOffsets,
+                                const DocDictionary::Slot* slots, size_t numSlots) {
+        if (offsets[0] != 0 || offsets[numOffsets - 1] > arenaSize || !std::is_sorted(offsets, offsets + numOffsets)) {
+            return false;
         }
+        bool hasEmpty = false;
+        for (size_t i = 0; i < numSlots; ++i) {
+            if (slots[i].id == DocDictionary::NOT_FOUND) {
+                hasEmpty = true;
+            }
+            else if (slots[i].id >= numOffsets - 1) {
+                return false;
+            }
+        }
+        return hasEmpty;
+    }
 
-        return result.str();
+    static bool isPowerOfTwo(size_t n) {
+        return n != 0 && (n & (n - 1)) == 0;
     }
 };
 
@@ -0,0 +1,284 @@
+#ifndef LSH_FOREST_H
+#define LSH_FOREST_H
+
+#include "MinHash.h"
+#include "DocDictionary.h"
+#include "NGram.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+// LSH Forest (Bawa, Condie and Ganesan, 2005): `numTrees` trees, each ordering the documents
+// by its own run of `depth` min-hash slots read as a prefix. Two documents meet in a tree at
+// prefix length r when their first r slots of that run agree, so the prefix length plays the
+// role of LSH's rows per band but is chosen per query: shorter for lower thresholds, and
+// shortened step by step for top-k until enough candidates are found. One index thus serves
+// every threshold. Each tree is a sorted array of document IDs rather than a trie; the range
+// sharing a prefix is found by binary search. Queries may run concurrently with each other but
+// not with insert().
+class LSHForest {
+public:
+    LSHForest(int numTrees = 20, int numHashes = 100, MinHashScheme scheme = MinHashScheme::Remix, int ngramSize = 3)
+        : numTrees(numTrees), depth(numHashes / numTrees), numSlots(numTrees * (numHashes / numTrees)),
+          ngramSize(ngramSize), hasher(numHashes, scheme), trees(numTrees) {}
+
+    // Adds a document, or replaces the signature of `label` if it is already indexed. Takes
+    // effect at the next build(), which queries run on demand.
+    void insert(std::string_view text, const std::string& label) {
+        auto row = keysOf(text);
+        std::lock_guard<std::mutex> lock(mutex_for_build);
+        uint32_t id = documents.intern(label);
+        rows.resize(documents.size() * numSlots);
+        std::copy(row.begin(), row.end(), rows.begin() + size_t(id) * numSlots);
+        built.store(false, std::memory_order_release);
+    }
+
+    // Indexes `terms` (each its own label), hashing them in parallel, and builds the trees.
+    void bulk_build(const std::vector<std::string>& terms) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_for_build);
+            std::vector<uint32_t> ids(terms.size());
+            for (size_t i = 0; i < terms.size(); ++i) {
+                ids[i] = documents.intern(terms[i]);
+            }
+            rows.resize(documents.size() * numSlots);
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, terms.size(), 64), [&](const tbb::blocked_range<size_t>& r) {
+                for (size_t i = r.begin(); i != r.end(); ++i) {
+                    auto row = keysOf(terms[i]);
+                    std::copy(row.begin(), row.end(), rows.begin() + size_t(ids[i]) * numSlots);
+                }
+            });
+            built.store(false, std::memory_order_release);
+        }
+        build();
+    }
+
+    // Sorts every tree by its prefix. Queries build on demand; call it once after the last
+    // insert() so the first queries do not pay for it.
+    void build() {
+        if (built.load(std::memory_order_acquire)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_for_build);
+        if (built.load(std::memory_order_acquire)) {
+            return;
+        }
+        tbb::parallel_for(0, numTrees, [&](int tree) {
+            auto& order = trees[tree];
+            order.resize(documents.size());
+            std::iota(order.begin(), order.end(), 0);
+            std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                const uint64_t* keysA = treeKeys(a, tree);
+                const uint64_t* keysB = treeKeys(b, tree);
+                return std::lexicographical_compare(keysA, keysA + depth, keysB, keysB + depth);
+            });
+        });
+        built.store(true, std::memory_order_release);
+    }
+
+    // Longest prefix at which a document of similarity `threshold` shares a prefix with the
+    // query in some tree with probability at least `minRecall`, 1 - (1 - s^r)^trees; never
+    // shorter than one slot.
+    int prefixLength(double threshold, double minRecall = 0.95) const {
+        for (int length = depth; length > 1; --length) {
+            if (1.0 - std::pow(1.0 - std::pow(threshold, length), numTrees) >= minRecall) {
+                return length;
+            }
+        }
+        return 1;
+    }
+
+    // IDs of the documents whose estimated similarity to `text` is at least `threshold`,
+    // ascending.
+    std::vector<uint32_t> query_ids(std::string_view text, double threshold, double minRecall = 0.95) {
+        build();
+        auto queryKeys = keysOf(text);
+        std::vector<uint32_t> candidates;
+        int length = prefixLength(threshold, minRecall);
+        for (int tree = 0; tree < numTrees; ++tree) {
+            auto [first, last] = prefixRange(tree, queryKeys.data() + tree * depth, length);
+            candidates.insert(candidates.end(), trees[tree].begin() + first, trees[tree].begin() + last);
+        }
+        std::sort(candidates.begin(), candidates.end());
+        candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+        size_t minMatches = static_cast<size_t>(std::ceil(threshold * numSlots - 1e-9));
+        std::vector<uint32_t> result;
+        for (uint32_t docID : candidates) {
+            if (matches(queryKeys.data(), docID) >= minMatches) {
+                result.push_back(docID);
+            }
+        }
+        return result;
+    }
+
+    std::unordered_set<std::string> query(std::string_view text, double threshold = 0.4, double minRecall = 0.95) {
+        std::unordered_set<std::string> result;
+        for (uint32_t docID : query_ids(text, threshold, minRecall)) {
+            result.emplace(documents.label(docID));
+        }
+        return result;
+    }
+
+    // query_ids() for every query, each at its own threshold, answered in parallel.
+    std::vector<std::vector<uint32_t>> query_batch(const std::vector<std::string>& queries,
+                                                   const std::vector<double>& thresholds, double minRecall = 0.95) {
+        build();
+        std::vector<std::vector<uint32_t>> results(queries.size());
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, queries.size(), 64), [&](const tbb::blocked_range<size_t>& r) {
+            for (size_t q = r.begin(); q != r.end(); ++q) {
+                results[q] = query_ids(queries[q], thresholds[q], minRecall);
+            }
+        });
+        return results;
+    }
+
+    // The k documents most similar to `text` with estimated similarity at least minThreshold,
+    // best first (ties by label). Prefixes are shortened in all trees together, from the full
+    // depth down, until at least `candidateFactor * k` distinct candidates are found or the
+    // prefix reaches the length prefixLength() gives for minThreshold.
+    std::vector<std::pair<std::string, double>> query_topk(std::string_view text, size_t k, double minThreshold = 0.0,
+                                                           size_t candidateFactor = 4) {
+        build();
+        if (k == 0) {
+            return {};
+        }
+        auto queryKeys = keysOf(text);
+        int shortest = minThreshold > 0 ? prefixLength(minThreshold) : 1;
+
+        // Each tree's range only widens as the prefix shrinks, so only its new ends are read.
+        std::vector<std::pair<size_t, size_t>> ranges(numTrees, {0, 0});
+        std::vector<uint32_t> candidates;
+        std::unordered_set<uint32_t> seen;
+        for (int length = depth; length >= shortest && candidates.size() < candidateFactor * k; --length) {
+            for (int tree = 0; tree < numTrees; ++tree) {
+                auto [first, last] = prefixRange(tree, queryKeys.data() + tree * depth, length);
+                auto [oldFirst, oldLast] = ranges[tree];
+                if (oldFirst == oldLast) {
+                    oldFirst = oldLast = first;
+                }
+                for (auto [from, to] : {std::make_pair(first, oldFirst), std::make_pair(oldLast, last)}) {
+                    for (size_t i = from; i < to; ++i) {
+                        if (seen.insert(trees[tree][i]).second) {
+                            candidates.push_back(trees[tree][i]);
+                        }
+                    }
+                }
+                ranges[tree] = {first, last};
+            }
+        }
+
+        std::vector<std::pair<std::string, double>> ranked;
+        for (uint32_t docID : candidates) {
+            double similarity = double(matches(queryKeys.data(), docID)) / numSlots;
+            if (similarity >= minThreshold) {
+                ranked.emplace_back(std::string(documents.label(docID)), similarity);
+            }
+        }
+        auto better = [](const auto& a, const auto& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        };
+        size_t count = std::min(k, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(), better);
+        ranked.resize(count);
+        return ranked;
+    }
+
+    std::string_view docLabel(uint32_t id) const {
+        return documents.label(id);
+    }
+
+    size_t size() const { return documents.size(); }
+    int getNumTrees() const { return numTrees; }
+    int getDepth() const { return depth; }
+
+    size_t memoryUsage() const {
+        size_t total = rows.capacity() * sizeof(uint64_t) + documents.memoryUsage();
+        for (const auto& order : trees) {
+            total += order.capacity() * sizeof(uint32_t);
+        }
+        return total;
+    }
+
+    // Identifies the parameters and contents that query results depend on, as LSH::fingerprint()
+    // does, for keying cached results. Each document counts with its signature, since insert()
+    // on an indexed label changes results without changing the labels.
+    uint64_t fingerprint() const {
+        uint64_t h = mix64(0x4C5348466F726573ULL ^ uint64_t(numTrees));
+        h = mix64(h ^ uint64_t(depth));
+        h = mix64(h ^ uint64_t(ngramSize));
+        h = mix64(h ^ uint64_t(hasher.getScheme()));
+        h = mix64(h ^ hasher.getSeed());
+        for (size_t id = 0; id < documents.size(); ++id) {
+            std::string_view label = documents.label(id);
+            uint64_t labelHash = hash_bytes(label.data(), label.size(), 0x2545F4914F6CDD1DULL);
+            uint64_t rowHash = hash_bytes(&rows[id * numSlots], numSlots * sizeof(uint64_t), labelHash);
+            h += mix64(labelHash ^ rowHash);
+        }
+        return mix64(h);
+    }
+
+private:
+    int numTrees;
+    int depth;
+    int numSlots;
+    int ngramSize;
+    MinHasher hasher;
+    DocDictionary documents;
+    // numSlots full 64-bit min-hash values per document, so prefixes and the accept rule compare
+    // slots as the banded index does; tree t reads slots [t * depth, (t + 1) * depth).
+    std::vector<uint64_t> rows;
+    // Document IDs of each tree, in lexicographic order of that tree's slots.
+    std::vector<std::vector<uint32_t>> trees;
+    std::mutex mutex_for_build;
+    std::atomic<bool> built{true};
+
+    std::vector<uint64_t> keysOf(std::string_view text) const {
+        auto signature = hasher.fromShingles([&](auto&& add) {
+            for_each_shingle(text, ngramSize, ShingleUnit::Char, [&](std::string_view shingle) {
+                add(hasher.shingleHash(shingle));
+            });
+        });
+        return std::vector<uint64_t>(signature.begin(), signature.begin() + numSlots);
+    }
+
+    const uint64_t* treeKeys(uint32_t docID, int tree) const {
+        return &rows[size_t(docID) * numSlots + size_t(tree) * depth];
+    }
+
+    size_t matches(const uint64_t* queryKeys, uint32_t docID) const {
+        const uint64_t* keys = &rows[size_t(docID) * numSlots];
+        size_t count = 0;
+        for (int i = 0; i < numSlots; ++i) {
+            count += keys[i] == queryKeys[i];
+        }
+        return count;
+    }
+
+    // Positions [first, last) in tree `tree` of the documents whose first `length` slots equal
+    // `prefix`.
+    std::pair<size_t, size_t> prefixRange(int tree, const uint64_t* prefix, int length) const {
+        const auto& order = trees[tree];
+        auto first = std::lower_bound(order.begin(), order.end(), prefix, [&](uint32_t docID, const uint64_t* key) {
+            const uint64_t* keys = treeKeys(docID, tree);
+            return std::lexicographical_compare(keys, keys + length, key, key + length);
+        });
+        auto last = std::upper_bound(first, order.end(), prefix, [&](const uint64_t* key, uint32_t docID) {
+            const uint64_t* keys = treeKeys(docID, tree);
+            return std::lexicographical_compare(key, key + length, keys, keys + length);
+        });
+        return {size_t(first - order.begin()), size_t(last - order.begin())};
+    }
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <algorithm>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a whole file, unmapped on destruction.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (addr && addr != MAP_FAILED) {
+            munmap(addr, length);
+        }
+    }
+
+    bool open(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return false;
+        }
+        length = static_cast<size_t>(st.st_size);
+        if (length > 0) {
+            addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            addr = nullptr;
+            length = 0;
+            return false;
+        }
+        return true;
+    }
+
+    const char* data() const { return static_cast<const char*>(addr); }
+    size_t size() const { return length; }
+
+    void advise(int advice) const {
+        if (addr) {
+            madvise(addr, length, advice);
+        }
+    }
+
+    // Drops the resident pages of [offset, offset + len) that lie entirely inside the range;
+    // they are read back from the file if touched again.
+    void release(size_t offset, size_t len) const {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t first = (offset + page - 1) / page * page;
+        size_t last = std::min(offset + len, length) / page * page;
+        if (addr && first < last) {
+            madvise(static_cast<char*>(addr) + first, last - first, MADV_DONTNEED);
+        }
+    }
+
+private:
+    void* addr = nullptr;
+    size_t length = 0;
+};
+
+#endif
@@ -0,0 +1,684 @@
+#ifndef MATCH_DAEMON_H
+#define MATCH_DAEMON_H
+
+#include "LSH.h"
+#include "QueryCache.h"
+#include "ResultWriter.h"
+#include "Wire.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <tbb/parallel_for.h>
+
+// Resident matching server. Clients send lists of ingredient phrases, or the n-gram queries
+// match() runs, over a Unix domain socket in Wire.h frames; requests that arrive close together
+// are coalesced so that all of their distinct queries reach the index in one pass.
+
+enum class DaemonMessage : uint8_t {
+    Match = 1,    // {uint32_t count, count x string ingredient} -> per ingredient {uint32_t n, n x {string id, string label, string definition}}
+    Stats = 2,    // -> {string json}
+    Shutdown = 3, // -> empty; the daemon exits once in-flight requests are answered
+    Reply = 4,
+    Error = 5,    // {string message}
+    Terms = 6,    // -> {uint32_t count, count x {string id, string label, string definition}}, the term table of the output
+    Query = 7,    // {uint64_t k, uint32_t count, count x {double threshold, string query}} -> per query {uint32_t n, n x {uint32_t term[, double score if k > 0]}}
+};
+
+struct DaemonOptions {
+    std::string socketPath;
+    // A batch goes to the index once it holds this many distinct queries, or once its oldest
+    // request has waited latencyBudgetUs.
+    size_t maxBatchQueries = 8192;
+    int latencyBudgetUs = 2000;
+    int probes = 0;
+};
+
+// Log-linear histogram of durations in nanoseconds: 16 linear sub-buckets per power of two,
+// so percentiles are within 1/16 of the true value at any scale.
+class LatencyHistogram {
+public:
+    LatencyHistogram() : counts(NUM_GROUPS * SUB_BUCKETS, 0) {}
+
+    void record(uint64_t ns) {
+        ++counts[bucketOf(ns)];
+        ++total;
+        maxNs = std::max(maxNs, ns);
+    }
+
+    // Upper bound of the bucket holding the `p` quantile (0 < p <= 1), in milliseconds.
+    double percentileMs(double p) const {
+        if (total == 0) {
+            return 0.0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * total + 0.5));
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < counts.size(); ++bucket) {
+            seen += counts[bucket];
+            if (seen >= rank) {
+                return std::min(upperBound(bucket), maxNs) * 1e-6;
+            }
+        }
+        return maxNs * 1e-6;
+    }
+
+    uint64_t count() const { return total; }
+    double maxMs() const { return maxNs * 1e-6; }
+
+private:
+    static constexpr size_t SUB_BUCKETS = 16;
+    static constexpr size_t NUM_GROUPS = 61;
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t maxNs = 0;
+
+    // Group 0 holds 0..15 exactly; group g >= 1 holds [16 << (g - 1), 32 << (g - 1)).
+    static size_t bucketOf(uint64_t ns) {
+        if (ns < SUB_BUCKETS) {
+            return ns;
+        }
+        int exponent = 63 - __builtin_clzll(ns);
+        size_t group = exponent - 3;
+        size_t sub = (ns >> (exponent - 4)) - SUB_BUCKETS;
+        return group * SUB_BUCKETS + sub;
+    }
+
+    static uint64_t upperBound(size_t bucket) {
+        size_t group = bucket / SUB_BUCKETS;
+        size_t sub = bucket % SUB_BUCKETS;
+        if (group == 0) {
+            return sub;
+        }
+        return ((SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+    }
+};
+
+class MatchDaemon {
+public:
+    // Turns an ingredient phrase into the (query, threshold) pairs whose matches it gets.
+    using QueryPlanner = std::function<void(std::string_view, std::vector<std::pair<std::string, double>>&)>;
+    // `terms` holds one entry per distinct ontology label, in the order the output files number
+    // them (Terms and Query replies index it).
+    MatchDaemon(LSH& lsh, const std::vector<OntologyTerm>& terms, QueryPlanner planner, DaemonOptions options)
+        : lsh(lsh), terms(terms), planner(std::move(planner)), options(std::move(options)),
+          cache(lsh.fingerprint() ^ static_cast<uint64_t>(this->options.probes)) {
+        for (uint32_t i = 0; i < terms.size(); ++i) {
+            termIndex.emplace(terms[i].label, i);
+        }
+    }
+
+    // Serves until a client sends Shutdown. Returns false if the socket could not be opened.
+    bool run() {
+        listener = listen_unix(options.socketPath);
+        if (listener < 0) {
+            return false;
+        }
+        std::cout << "Serving matches on " << options.socketPath << std::endl;
+        std::thread batcher([this] { batchLoop(); });
+
+        while (!stopping.load()) {
+            int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            std::lock_guard<std::mutex> lock(connectionMutex);
+            openConnections.insert(fd);
+            std::thread([this, fd] { serveConnection(fd); }).detach();
+        }
+
+        stop();
+        {
+            // Wake connections blocked reading from idle clients, then wait for them to close.
+            std::unique_lock<std::mutex> lock(connectionMutex);
+            for (int fd : openConnections) {
+                ::shutdown(fd, SHUT_RDWR);
+            }
+            connectionsClosed.wait(lock, [&] { return openConnections.empty(); });
+        }
+        batcher.join();
+        ::close(listener);
+        ::unlink(options.socketPath.c_str());
+        return true;
+    }
+
+    nlohmann::json stats() const {
+        std::lock_guard<std::mutex> lock(statsMutex);
+        nlohmann::json result;
+        result["requests"] = numRequests;
+        result["ingredients"] = numIngredients;
+        result["batches"] = numBatches;
+        result["index_queries"] = numIndexQueries;
+        result["mean_requests_per_batch"] = numBatches ? double(numRequests) / numBatches : 0.0;
+        result["queue_depth"] = queueDepth.load();
+        result["max_queue_depth"] = maxQueueDepth;
+        result["cache_hits"] = cache.hits();
+        result["cache_misses"] = cache.misses();
+        result["latency_ms"] = {{"p50", latency.percentileMs(0.5)},
+                                {"p90", latency.percentileMs(0.9)},
+                                {"p99", latency.percentileMs(0.99)},
+                                {"p999", latency.percentileMs(0.999)},
+                                {"max", latency.maxMs()}};
+        return result;
+    }
+
+private:
+    struct Pending {
+        std::vector<std::string> ingredients;
+        // The planned queries of each ingredient; for a Query request, one query per entry.
+        std::vector<std::vector<std::pair<std::string, double>>> queries;
+        // Query requests are answered with term indexes, ranked when k > 0.
+        bool byTerm = false;
+        size_t k = 0;
+        size_t numQueries = 0;
+        std::chrono::steady_clock::time_point enqueued;
+        std::promise<std::vector<char>> reply;
+    };
+
+    LSH& lsh;
+    const std::vector<OntologyTerm>& terms;
+    std::unordered_map<std::string_view, uint32_t> termIndex;
+    QueryPlanner planner;
+    DaemonOptions options;
+    QueryCache cache;
+    int listener = -1;
+    std::atomic<bool> stopping{false};
+
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    std::deque<std::shared_ptr<Pending>> queue;
+    size_t queuedQueries = 0;
+    std::atomic<size_t> queueDepth{0};
+
+    std::mutex connectionMutex;
+    std::condition_variable connectionsClosed;
+    std::unordered_set<int> openConnections;
+
+    mutable std::mutex statsMutex;
+    LatencyHistogram latency;
+    uint64_t numRequests = 0;
+    uint64_t numIngredients = 0;
+    uint64_t numBatches = 0;
+    uint64_t numIndexQueries = 0;
+    size_t maxQueueDepth = 0;
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping.store(true);
+        }
+        queueReady.notify_all();
+        ::shutdown(listener, SHUT_RDWR);
+    }
+
+    void serveConnection(int fd) {
+        uint8_t type;
+        std::vector<char> payload;
+        while (read_frame(fd, type, payload)) {
+            std::vector<char> reply;
+            std::string error;
+            bool stopRequested = false;
+            switch (static_cast<DaemonMessage>(type)) {
+            case DaemonMessage::Match:
+            case DaemonMessage::Query: {
+                auto pending = std::make_shared<Pending>();
+                std::future<std::vector<char>> answer = pending->reply.get_future();
+                bool parsed = static_cast<DaemonMessage>(type) == DaemonMessage::Match ? parseMatch(payload, *pending)
+                                                                                      : parseQuery(payload, *pending);
+                if (!parsed) {
+                    error = "malformed request";
+                }
+                else if (!enqueue(pending)) {
+                    error = "shutting down";
+                }
+                else {
+                    reply = answer.get();
+                }
+                break;
+            }
+            case DaemonMessage::Terms: {
+                WireWriter writer;
+                writer.put(static_cast<uint32_t>(terms.size()));
+                for (const auto& term : terms) {
+                    writer.putString(term.id);
+                    writer.putString(term.label);
+                    writer.putString(term.definition);
+                }
+                reply = writer.bytes();
+                break;
+            }
+            case DaemonMessage::Stats: {
+                WireWriter writer;
+                writer.putString(stats().dump());
+                reply = writer.bytes();
+                break;
+            }
+            case DaemonMessage::Shutdown:
+                // Stopped only once the reply is out, since stopping shuts down every connection.
+                stopRequested = true;
+                break;
+            default:
+                error = "unknown request";
+                break;
+            }
+
+            if (!error.empty()) {
+                WireWriter writer;
+                writer.putString(error);
+                reply = writer.bytes();
+            }
+            bool written = write_frame(fd, static_cast<uint8_t>(error.empty() ? DaemonMessage::Reply : DaemonMessage::Error), reply);
+            if (stopRequested) {
+                stop();
+            }
+            if (!written) {
+                break;
+            }
+        }
+        std::lock_guard<std::mutex> lock(connectionMutex);
+        openConnections.erase(fd);
+        ::close(fd);
+        connectionsClosed.notify_all();
+    }
+
+    // Parses the ingredients and plans their queries on the connection's own thread, so the
+    // batcher only probes the index.
+    bool parseMatch(const std::vector<char>& payload, Pending& pending) {
+        WireReader request(payload);
+        uint32_t count;
+        if (!request.get(count)) {
+            return false;
+        }
+        pending.ingredients.resize(count);
+        pending.queries.resize(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!request.getString(pending.ingredients[i])) {
+                return false;
+            }
+            planner(pending.ingredients[i], pending.queries[i]);
+            pending.numQueries += pending.queries[i].size();
+        }
+        return request.done();
+    }
+
+    bool parseQuery(const std::vector<char>& payload, Pending& pending) {
+        WireReader request(payload);
+        uint64_t k;
+        uint32_t count;
+        if (!request.get(k) || !request.get(count)) {
+            return false;
+        }
+        pending.byTerm = true;
+        pending.k = k;
+        pending.queries.resize(count);
+        for (auto& planned : pending.queries) {
+            double threshold;
+            std::string query;
+            if (!request.get(threshold) || !request.getString(query)) {
+                return false;
+            }
+            planned.emplace_back(std::move(query), threshold);
+        }
+        pending.numQueries = count;
+        return request.done();
+    }
+
+    bool enqueue(const std::shared_ptr<Pending>& pending) {
+        pending->enqueued = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (stopping.load()) {
+                return false;
+            }
+            queue.push_back(pending);
+            queuedQueries += pending->numQueries;
+            queueDepth.store(queue.size());
+        }
+        queueReady.notify_all();
+        return true;
+    }
+
+    // Waits for a request, then for the batch to fill or the oldest request's latency budget
+    // to run out, and answers the queued requests in one pass, oldest first, up to
+    // maxBatchQueries queries; the rest stay queued for the next pass. A request larger than
+    // the limit makes a batch of its own. Drains the queue before returning on shutdown.
+    void batchLoop() {
+        for (;;) {
+            std::vector<std::shared_ptr<Pending>> batch;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueReady.wait(lock, [&] { return stopping.load() || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                auto deadline = queue.front()->enqueued + std::chrono::microseconds(options.latencyBudgetUs);
+                queueReady.wait_until(lock, deadline, [&] {
+                    return stopping.load() || queuedQueries >= options.maxBatchQueries;
+                });
+                {
+                    std::lock_guard<std::mutex> statsLock(statsMutex);
+                    maxQueueDepth = std::max(maxQueueDepth, queue.size());
+                }
+                size_t batchQueries = 0;
+                while (!queue.empty() &&
+                       (batch.empty() || batchQueries + queue.front()->numQueries <= options.maxBatchQueries)) {
+                    batchQueries += queue.front()->numQueries;
+                    batch.push_back(std::move(queue.front()));
+                    queue.pop_front();
+                }
+                queuedQueries -= batchQueries;
+                queueDepth.store(queue.size());
+            }
+            answer(batch);
+        }
+    }
+
+    void answer(const std::vector<std::shared_ptr<Pending>>& batch) {
+        // Distinct (query, threshold, k) triples of the whole batch, answered from the cache
+        // where possible; the threshold queries go to the index in one call and the ranked
+        // ones in parallel.
+        std::unordered_map<std::string, size_t> slots;
+        std::vector<QueryCache::Entry> results;
+        std::vector<std::string> queries;
+        std::vector<double> thresholds;
+        std::vector<size_t> missed;
+        std::vector<std::pair<const Pending*, const std::pair<std::string, double>*>> rankedQueries;
+        std::vector<size_t> rankedMissed;
+        for (const auto& pending : batch) {
+            for (const auto& planned : pending->queries) {
+                for (const auto& entry : planned) {
+                    const auto& [query, threshold] = entry;
+                    std::string key = QueryCache::key(query, threshold, pending->k);
+                    auto [it, inserted] = slots.emplace(key, results.size());
+                    if (!inserted) {
+                        continue;
+                    }
+                    results.emplace_back();
+                    if (cache.find(key, results.back())) {
+                        continue;
+                    }
+                    if (pending->k > 0) {
+                        rankedMissed.push_back(results.size() - 1);
+                        rankedQueries.emplace_back(pending.get(), &entry);
+                    }
+                    else {
+                        missed.push_back(results.size() - 1);
+                        queries.push_back(query);
+                        thresholds.push_back(threshold);
+                    }
+                }
+            }
+        }
+
+        auto matches = lsh.query_batch(queries, thresholds, options.probes);
+        std::vector<const std::string*> keys(results.size());
+        for (const auto& [key, slot] : slots) {
+            keys[slot] = &key;
+        }
+        for (size_t m = 0; m < missed.size(); ++m) {
+            auto& labels = results[missed[m]].labels;
+            for (uint32_t docID : matches[m]) {
+                labels.emplace_back(lsh.docLabel(docID));
+            }
+            cache.insert(*keys[missed[m]], results[missed[m]]);
+        }
+        tbb::parallel_for(size_t(0), rankedMissed.size(), [&](size_t m) {
+            const auto& [pending, entry] = rankedQueries[m];
+            QueryCache::Entry& result = results[rankedMissed[m]];
+            for (auto& [label, score] : lsh.query_topk(entry->first, pending->k, entry->second, options.probes)) {
+                result.labels.push_back(std::move(label));
+                result.scores.push_back(score);
+            }
+            cache.insert(*keys[rankedMissed[m]], result);
+        });
+
+        auto now = std::chrono::steady_clock::now();
+        uint64_t ingredients = 0;
+        for (const auto& pending : batch) {
+            WireWriter reply;
+            if (pending->byTerm) {
+                putTerms(*pending, results, slots, reply);
+                pending->reply.set_value(reply.bytes());
+                continue;
+            }
+            for (const auto& planned : pending->queries) {
+                std::set<std::string_view> labels;
+                for (const auto& [query, threshold] : planned) {
+                    for (const auto& label : results[slots.at(QueryCache::key(query, threshold))].labels) {
+                        labels.insert(label);
+                    }
+                }
+                reply.put(static_cast<uint32_t>(labels.size()));
+                for (std::string_view label : labels) {
+                    auto it = termIndex.find(label);
+                    reply.putString(it == termIndex.end() ? std::string_view() : std::string_view(terms[it->second].id));
+                    reply.putString(label);
+                    reply.putString(it == termIndex.end() ? std::string_view() : std::string_view(terms[it->second].definition));
+                }
+            }
+            ingredients += pending->ingredients.size();
+            pending->reply.set_value(reply.bytes());
+        }
+
+        std::lock_guard<std::mutex> lock(statsMutex);
+        for (const auto& pending : batch) {
+            latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - pending->enqueued).count());
+        }
+        numRequests += batch.size();
+        numIngredients += ingredients;
+        numBatches += 1;
+        numIndexQueries += queries.size() + rankedMissed.size();
+    }
+
+    // The reply to a Query request: each query's matches as term indexes, in the order the
+    // index returned them, with their scores if ranked.
+    void putTerms(const Pending& pending, const std::vector<QueryCache::Entry>& results,
+                  const std::unordered_map<std::string, size_t>& slots, WireWriter& reply) const {
+        std::vector<std::pair<uint32_t, double>> matched;
+        for (const auto& planned : pending.queries) {
+            const auto& [query, threshold] = planned.front();
+            const QueryCache::Entry& result = results[slots.at(QueryCache::key(query, threshold, pending.k))];
+            matched.clear();
+            for (size_t i = 0; i < result.labels.size(); ++i) {
+                auto it = termIndex.find(result.labels[i]);
+                if (it != termIndex.end()) {
+                    matched.emplace_back(it->second, pending.k > 0 ? result.scores[i] : 0.0);
+                }
+            }
+            reply.put(static_cast<uint32_t>(matched.size()));
+            for (const auto& [term, score] : matched) {
+                reply.put(term);
+                if (pending.k > 0) {
+                    reply.put(score);
+                }
+            }
+        }
+    }
+};
+
+struct DaemonMatch {
+    std::string id;
+    std::string label;
+    std::string definition;
+};
+
+// Client side of the daemon protocol over one connection. Requests from several threads take
+// turns on the connection.
+class MatchClient {
+public:
+    MatchClient() = default;
+    MatchClient(const MatchClient&) = delete;
+    MatchClient& operator=(const MatchClient&) = delete;
+
+    ~MatchClient() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    bool connect(const std::string& socketPath) {
+        fd = connect_unix(socketPath);
+        return fd >= 0;
+    }
+
+    // The ontology terms matching each of `ingredients`, sorted by label.
+    bool match(const std::vector<std::string>& ingredients, std::vector<std::vector<DaemonMatch>>& results) {
+        WireWriter request;
+        request.put(static_cast<uint32_t>(ingredients.size()));
+        for (const auto& ingredient : ingredients) {
+            request.putString(ingredient);
+        }
+        std::vector<char> payload;
+        if (!roundTrip(DaemonMessage::Match, request, payload)) {
+            return false;
+        }
+        WireReader reply(payload);
+        results.assign(ingredients.size(), {});
+        for (auto& result : results) {
+            uint32_t count;
+            if (!reply.get(count)) {
+                return malformed();
+            }
+            result.resize(count);
+            for (auto& match : result) {
+                if (!reply.getString(match.id) || !reply.getString(match.label) || !reply.getString(match.definition)) {
+                    return malformed();
+                }
+            }
+        }
+        return true;
+    }
+
+    // Fetches the daemon's term table, which query_batch() and query_topk_batch() results
+    // index.
+    bool loadTerms() {
+        std::vector<char> payload;
+        if (!roundTrip(DaemonMessage::Terms, WireWriter(), payload)) {
+            return false;
+        }
+        WireReader reply(payload);
+        uint32_t count;
+        if (!reply.get(count)) {
+            return malformed();
+        }
+        terms.assign(count, {});
+        for (auto& term : terms) {
+            if (!reply.getString(term.id) || !reply.getString(term.label) || !reply.getString(term.definition)) {
+                return malformed();
+            }
+        }
+        return reply.done() || malformed();
+    }
+
+    const std::vector<OntologyTerm>& getTerms() const { return terms; }
+    std::string_view docLabel(uint32_t id) const { return terms[id].label; }
+
+    // Term indexes of the documents matching each query at its threshold.
+    bool query_batch(const std::vector<std::string>& queries, const std::vector<double>& thresholds,
+                     std::vector<std::vector<uint32_t>>& results) {
+        std::vector<std::vector<std::pair<uint32_t, double>>> scored;
+        if (!query(queries, thresholds, 0, scored)) {
+            return false;
+        }
+        results.assign(queries.size(), {});
+        for (size_t i = 0; i < scored.size(); ++i) {
+            for (const auto& [term, score] : scored[i]) {
+                results[i].push_back(term);
+            }
+        }
+        return true;
+    }
+
+    // The k best (term index, similarity) pairs per query, best first.
+    bool query_topk_batch(const std::vector<std::string>& queries, const std::vector<double>& thresholds, size_t k,
+                          std::vector<std::vector<std::pair<uint32_t, double>>>& results) {
+        return query(queries, thresholds, k, results);
+    }
+
+    bool stats(std::string& json) {
+        std::vector<char> payload;
+        return roundTrip(DaemonMessage::Stats, WireWriter(), payload) && WireReader(payload).getString(json);
+    }
+
+    bool shutdown() {
+        std::vector<char> payload;
+        return roundTrip(DaemonMessage::Shutdown, WireWriter(), payload);
+    }
+
+private:
+    int fd = -1;
+    std::vector<OntologyTerm> terms;
+    std::mutex mutex;
+
+    bool query(const std::vector<std::string>& queries, const std::vector<double>& thresholds, size_t k,
+               std::vector<std::vector<std::pair<uint32_t, double>>>& results) {
+        WireWriter request;
+        request.put(static_cast<uint64_t>(k));
+        request.put(static_cast<uint32_t>(queries.size()));
+        for (size_t i = 0; i < queries.size(); ++i) {
+            request.put(thresholds[i]);
+            request.putString(queries[i]);
+        }
+        std::vector<char> payload;
+        if (!roundTrip(DaemonMessage::Query, request, payload)) {
+            return false;
+        }
+        WireReader reply(payload);
+        results.assign(queries.size(), {});
+        for (auto& result : results) {
+            uint32_t count, term;
+            double score = 0.0;
+            if (!reply.get(count)) {
+                return malformed();
+            }
+            for (uint32_t j = 0; j < count; ++j) {
+                if (!reply.get(term) || (k > 0 && !reply.get(score)) || term >= terms.size()) {
+                    return malformed();
+                }
+                result.emplace_back(term, score);
+            }
+        }
+        return true;
+    }
+
+    bool roundTrip(DaemonMessage type, const WireWriter& request, std::vector<char>& payload) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uint8_t replyType;
+        if (!write_frame(fd, static_cast<uint8_t>(type), request.bytes()) || !read_frame(fd, replyType, payload)) {
+            std::cerr << "Lost connection to the matching daemon" << std::endl;
+            return false;
+        }
+        if (replyType != static_cast<uint8_t>(DaemonMessage::Reply)) {
+            std::string message;
+            WireReader(payload).getString(message);
+            std::cerr << "Matching daemon failed: " << message << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    static bool malformed() {
+        std::cerr << "Malformed reply from the matching daemon" << std::endl;
+        return false;
+    }
+};
+
+#endif
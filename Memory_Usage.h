@@ -16,4 +16,16 @@ void print_memory_usage() {
     }
 }
 
+// Peak resident set size of this process in kilobytes (VmHWM), or 0 if unavailable.
+size_t peak_memory_kb() {
+    std::string line;
+    std::ifstream status("/proc/self/status");
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0) {
+            return std::stoul(line.substr(6));
+        }
+    }
+    return 0;
+}
+
 #endif
\ No newline at end of file
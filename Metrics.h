@@ -0,0 +1,181 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "AllocationStats.h"
+#include "Memory_Usage.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/resource.h>
+
+// Process-wide instrumentation: wall and CPU time per named stage, named counters, allocation
+// counts and peak RSS, written as a JSON report; with tracing enabled every timed scope is
+// also kept as a span for a Chrome trace-event file (chrome://tracing or Perfetto).
+class Metrics {
+public:
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    void enableTrace() { trace = true; }
+
+    void addCounter(const std::string& name, uint64_t value) {
+        std::lock_guard<std::mutex> lock(mutex);
+        counters[name] += value;
+    }
+
+    // Called by ScopedStage when a scope ends; `cpuNs` is the CPU time of the calling thread.
+    void recordSpan(const char* name, uint64_t startNs, uint64_t wallNs, uint64_t cpuNs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto [it, inserted] = stageIndex.emplace(name, stages.size());
+        if (inserted) {
+            stages.push_back(Stage{name});
+        }
+        Stage& stage = stages[it->second];
+        ++stage.count;
+        stage.wallNs += wallNs;
+        stage.cpuNs += cpuNs;
+        stage.maxWallNs = std::max(stage.maxWallNs, wallNs);
+        if (trace) {
+            spans.push_back(Span{name, thread_index(), startNs, wallNs});
+        }
+    }
+
+    static uint64_t nowNs() {
+        return clockNs(CLOCK_MONOTONIC) - instance().startNs;
+    }
+
+    static uint64_t threadCpuNs() {
+        return clockNs(CLOCK_THREAD_CPUTIME_ID);
+    }
+
+    static uint64_t allocationCount() {
+        uint64_t total = 0;
+        for (const auto& stripe : allocation_stripes) {
+            total += stripe.count.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    static uint64_t allocatedBytes() {
+        uint64_t total = 0;
+        for (const auto& stripe : allocation_stripes) {
+            total += stripe.bytes.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    // Stage CPU time counts only the thread that opened the scope; work a stage hands to TBB
+    // workers shows up in the process totals and in the workers' own spans.
+    bool writeReport(const std::string& filename) {
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        nlohmann::json report;
+        report["wall_seconds"] = nowNs() * 1e-9;
+        report["user_cpu_seconds"] = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6;
+        report["system_cpu_seconds"] = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+        report["peak_rss_kb"] = peak_memory_kb();
+        report["allocations"] = allocationCount();
+        report["allocated_bytes"] = allocatedBytes();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        report["stages"] = nlohmann::json::array();
+        for (const Stage& stage : stages) {
+            report["stages"].push_back({{"name", stage.name},
+                                        {"count", stage.count},
+                                        {"wall_seconds", stage.wallNs * 1e-9},
+                                        {"max_wall_seconds", stage.maxWallNs * 1e-9},
+                                        {"cpu_seconds", stage.cpuNs * 1e-9}});
+        }
+        report["counters"] = counters;
+        return writeJson(filename, report);
+    }
+
+    bool writeTrace(const std::string& filename) {
+        std::lock_guard<std::mutex> lock(mutex);
+        nlohmann::json events = nlohmann::json::array();
+        uint32_t numThreads = 0;
+        for (const Span& span : spans) {
+            events.push_back({{"name", span.name}, {"cat", "stage"}, {"ph", "X"}, {"pid", 1}, {"tid", span.thread},
+                              {"ts", span.startNs / 1000.0}, {"dur", span.wallNs / 1000.0}});
+            numThreads = std::max(numThreads, span.thread + 1);
+        }
+        for (uint32_t thread = 0; thread < numThreads; ++thread) {
+            events.push_back({{"name", "thread_name"}, {"ph", "M"}, {"pid", 1}, {"tid", thread},
+                              {"args", {{"name", thread == 0 ? "main" : "worker " + std::to_string(thread)}}}});
+        }
+        return writeJson(filename, {{"traceEvents", events}, {"displayTimeUnit", "ms"}});
+    }
+
+private:
+    struct Stage {
+        std::string name;
+        uint64_t count = 0;
+        uint64_t wallNs = 0;
+        uint64_t cpuNs = 0;
+        uint64_t maxWallNs = 0;
+    };
+
+    struct Span {
+        const char* name;
+        uint32_t thread;
+        uint64_t startNs;
+        uint64_t wallNs;
+    };
+
+    std::mutex mutex;
+    bool trace = false;
+    uint64_t startNs;
+    std::vector<Stage> stages;
+    std::unordered_map<std::string, size_t> stageIndex;
+    std::map<std::string, uint64_t> counters;
+    std::vector<Span> spans;
+
+    Metrics() : startNs(clockNs(CLOCK_MONOTONIC)) {}
+
+    static uint64_t clockNs(clockid_t clock) {
+        timespec ts{};
+        clock_gettime(clock, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+    }
+
+    static bool writeJson(const std::string& filename, const nlohmann::json& document) {
+        std::ofstream outFile(filename);
+        if (!outFile.is_open()) {
+            std::cerr << "Failed to open " << filename << std::endl;
+            return false;
+        }
+        outFile << document.dump(1) << "\n";
+        return outFile.good();
+    }
+};
+
+// Times the enclosing scope as one occurrence of stage `name` (a string literal).
+class ScopedStage {
+public:
+    explicit ScopedStage(const char* name)
+        : name(name), startNs(Metrics::nowNs()), cpuStartNs(Metrics::threadCpuNs()) {}
+
+    ~ScopedStage() {
+        Metrics::instance().recordSpan(name, startNs, Metrics::nowNs() - startNs, Metrics::threadCpuNs() - cpuStartNs);
+    }
+
+    ScopedStage(const ScopedStage&) = delete;
+    ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+    const char* name;
+    uint64_t startNs;
+    uint64_t cpuStartNs;
+};
+
+#endif
@@ -1,45 +1,86 @@
 #ifndef MINHASH_H
 #define MINHASH_H
 
-#include <openssl/sha.h>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <iostream>
-#include <iomanip>
-#include <sstream>
+#include <cstdint>
+#include <cstring>
 #include <cassert>
 #include <climits>
 
-class HashFunc {
-public:
-    HashFunc(int seed) : seed(seed) {}
+// Finalizer from splitmix64, used to re-mix 64-bit values into independent permutations.
+uint64_t mix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
 
-    unsigned long operator()(const std::string& x) const {
-        std::ostringstream oss;
-        oss << x << seed;
-        std::string input = oss.str();
+// Seeded 64-bit hash of a byte string (MurmurHash64A).
+uint64_t hash_bytes(const void* key, size_t len, uint64_t seed) {
+    const uint64_t m = 0xC6A4A7935BD1E995ULL;
+    const int r = 47;
 
-        unsigned char hash[SHA_DIGEST_LENGTH];
-        SHA1(reinterpret_cast<const unsigned char*>(input.c_str()), input.size(), hash);
+    const unsigned char* data = static_cast<const unsigned char*>(key);
+    const unsigned char* end = data + (len & ~size_t(7));
+    uint64_t h = seed ^ (len * m);
 
-        unsigned long hashValue = 0;
-        for (int i = 0; i < SHA_DIGEST_LENGTH / sizeof(unsigned long); ++i) {
-            hashValue ^= reinterpret_cast<unsigned long*>(hash)[i];
-        }
+    for (; data != end; data += 8) {
+        uint64_t k;
+        std::memcpy(&k, data, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    switch (len & 7) {
+        case 7: h ^= uint64_t(data[6]) << 48; [[fallthrough]];
+        case 6: h ^= uint64_t(data[5]) << 40; [[fallthrough]];
+        case 5: h ^= uint64_t(data[4]) << 32; [[fallthrough]];
+        case 4: h ^= uint64_t(data[3]) << 24; [[fallthrough]];
+        case 3: h ^= uint64_t(data[2]) << 16; [[fallthrough]];
+        case 2: h ^= uint64_t(data[1]) << 8; [[fallthrough]];
+        case 1: h ^= uint64_t(data[0]);
+                h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+class HashFunc {
+public:
+    HashFunc(uint64_t seed) : seed(seed), salt(mix64(seed)) {}
 
-        return hashValue;
+    unsigned long operator()(std::string_view x) const {
+        return hash_bytes(x.data(), x.size(), seed);
+    }
+
+    // Derive this function's value from a shingle hash computed once with another seed.
+    unsigned long remix(uint64_t shingleHash) const {
+        return mix64(shingleHash ^ salt);
     }
 
 private:
-    int seed;
+    uint64_t seed;
+    uint64_t salt;
 };
 
+// Classic k-function MinHash: every shingle is hashed once and re-mixed per function.
 std::vector<unsigned long> minhash(const std::vector<std::string>& ngrams, const std::vector<HashFunc>& hashFuncs) {
     std::vector<unsigned long> minhashSignatures(hashFuncs.size(), ULONG_MAX);
+    HashFunc base(0);
 
     for (const auto& ngram : ngrams) {
+        uint64_t h = base(ngram);
         for (size_t i = 0; i < hashFuncs.size(); ++i) {
-            unsigned long hashVal = hashFuncs[i](ngram);
+            unsigned long hashVal = hashFuncs[i].remix(h);
             minhashSignatures[i] = std::min(minhashSignatures[i], hashVal);
         }
     }
@@ -47,6 +88,130 @@ std::vector<unsigned long> minhash(const std::vector<std::string>& ngrams, const
     return minhashSignatures;
 }
 
+enum class MinHashScheme : uint32_t {
+    Remix = 0,         // one hash per shingle, re-mixed for each of the k functions
+    OnePermutation = 1 // one hash per shingle, binned, with optimal densification
+};
+
+class MinHasher {
+public:
+    MinHasher(int numHashes, MinHashScheme scheme = MinHashScheme::Remix, uint64_t seed = 0)
+        : numHashes(numHashes), scheme(scheme), seed(seed) {
+        for (int i = 0; i < numHashes; ++i) {
+            hashFuncs.emplace_back(seed + i + 1);
+        }
+    }
+
+    std::vector<unsigned long> operator()(const std::vector<std::string>& ngrams) const {
+        return fromShingles([&](auto&& add) {
+            for (const auto& ngram : ngrams) {
+                add(shingleHash(ngram));
+            }
+        });
+    }
+
+    // Hash of one shingle; every per-slot value is derived from it.
+    uint64_t shingleHash(std::string_view shingle) const {
+        return hash_bytes(shingle.data(), shingle.size(), seed);
+    }
+
+    // Builds a signature without materializing shingles: `generate` is called once with a
+    // callback and feeds it the shingleHash() of every shingle.
+    template<typename Generator>
+    std::vector<unsigned long> fromShingles(Generator&& generate) const {
+        std::vector<unsigned long> signature(numHashes, ULONG_MAX);
+
+        if (scheme == MinHashScheme::Remix) {
+            generate([&](uint64_t h) {
+                for (int i = 0; i < numHashes; ++i) {
+                    signature[i] = std::min(signature[i], hashFuncs[i].remix(h));
+                }
+            });
+            return signature;
+        }
+
+        generate([&](uint64_t h) {
+            size_t bin = binOf(h);
+            signature[bin] = std::min<unsigned long>(signature[bin], h);
+        });
+        densify(signature);
+        return signature;
+    }
+
+    // Like fromShingles(), and also fills `runnersUp` with the second smallest distinct value of
+    // every slot (ULONG_MAX if a slot saw only one). Multi-probe queries build their extra
+    // probes from these. One-permutation hashing has no per-slot runner-up, so under that
+    // scheme `runnersUp` is all ULONG_MAX.
+    template<typename Generator>
+    std::vector<unsigned long> fromShinglesWithRunnersUp(Generator&& generate, std::vector<unsigned long>& runnersUp) const {
+        runnersUp.assign(numHashes, ULONG_MAX);
+        if (scheme != MinHashScheme::Remix) {
+            return fromShingles(generate);
+        }
+
+        std::vector<unsigned long> signature(numHashes, ULONG_MAX);
+        generate([&](uint64_t h) {
+            for (int i = 0; i < numHashes; ++i) {
+                unsigned long value = hashFuncs[i].remix(h);
+                if (value < signature[i]) {
+                    runnersUp[i] = signature[i];
+                    signature[i] = value;
+                }
+                else if (value < runnersUp[i] && value != signature[i]) {
+                    runnersUp[i] = value;
+                }
+            }
+        });
+        return signature;
+    }
+
+    int size() const { return numHashes; }
+    MinHashScheme getScheme() const { return scheme; }
+    uint64_t getSeed() const { return seed; }
+
+private:
+    int numHashes;
+    MinHashScheme scheme;
+    uint64_t seed;
+    std::vector<HashFunc> hashFuncs;
+
+    size_t binOf(uint64_t h) const {
+        return static_cast<size_t>(((h >> 32) * static_cast<uint64_t>(numHashes)) >> 32);
+    }
+
+    // Optimal densification (Shrivastava, ICML 2017): an empty bin borrows the value of the
+    // first non-empty bin along its own seeded probe sequence, so equal sets stay equal and
+    // the collision probability of every bin remains the Jaccard similarity.
+    void densify(std::vector<unsigned long>& signature) const {
+        std::vector<char> filled(numHashes);
+        size_t numFilled = 0;
+        for (int i = 0; i < numHashes; ++i) {
+            filled[i] = signature[i] != ULONG_MAX;
+            numFilled += filled[i];
+        }
+        if (numFilled == 0 || numFilled == static_cast<size_t>(numHashes)) {
+            return;
+        }
+
+        for (int i = 0; i < numHashes; ++i) {
+            if (filled[i]) {
+                continue;
+            }
+            for (uint64_t attempt = 0;; ++attempt) {
+                size_t j = binOf(mix64(seed ^ (static_cast<uint64_t>(i) << 32 | attempt)));
+                if (filled[j]) {
+                    signature[i] = signature[j];
+                    break;
+                }
+            }
+        }
+    }
+};
+
+std::vector<unsigned long> minhash(const std::vector<std::string>& ngrams, const MinHasher& hasher) {
+    return hasher(ngrams);
+}
+
 double jaccard_similarity(const std::vector<unsigned long>& signature1, const std::vector<unsigned long>& signature2) {
     assert(signature1.size() == signature2.size());
 
@@ -60,4 +225,4 @@ double jaccard_similarity(const std::vector<unsigned long>& signature1, const st
     return static_cast<double>(matchCount) / signature1.size();
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <algorithm>
+#include <string_view>
 
 std::vector<std::string> split(const std::string &text) {
     std::istringstream iss(text);
@@ -15,15 +17,51 @@ std::vector<std::string> split(const std::string &text) {
     return tokens;
 }
 
-std::vector<std::string> text_to_ngrams(const std::string& text, int n = 3) {
-    std::vector<std::string> ngrams;
-    if (text.size() < n) {
-        ngrams.push_back(text);
-        return ngrams;
+enum class ShingleUnit {
+    Char, // n consecutive bytes
+    Word  // n consecutive words of text whose words are separated by single spaces
+};
+
+// Slides a window of `n` units over `text` and calls `func` with each shingle as a view into
+// `text`, so shingles can be hashed in place instead of being copied into strings. Text with
+// fewer than `n` units yields itself as its only shingle.
+template<typename Func>
+void for_each_shingle(std::string_view text, int n, ShingleUnit unit, Func&& func) {
+    size_t numUnits = unit == ShingleUnit::Char ? text.size()
+                      : text.empty() ? 0 : std::count(text.begin(), text.end(), ' ') + 1;
+    if (numUnits < static_cast<size_t>(n)) {
+        func(text);
+        return;
     }
-    for (size_t i = 0; i <= text.size() - n; ++i) {
-        ngrams.push_back(text.substr(i, n));
+    if (unit == ShingleUnit::Char) {
+        for (size_t i = 0; i + n <= text.size(); ++i) {
+            func(text.substr(i, n));
+        }
+        return;
+    }
+
+    // `first` is the start of the window's first word and `last` the start of its last word.
+    size_t first = 0;
+    size_t last = 0;
+    for (int j = 1; j < n; ++j) {
+        last = text.find(' ', last) + 1;
     }
+    for (;;) {
+        size_t end = text.find(' ', last);
+        func(text.substr(first, (end == std::string_view::npos ? text.size() : end) - first));
+        if (end == std::string_view::npos) {
+            return;
+        }
+        last = end + 1;
+        first = text.find(' ', first) + 1;
+    }
+}
+
+std::vector<std::string> text_to_ngrams(const std::string& text, int n = 3) {
+    std::vector<std::string> ngrams;
+    for_each_shingle(text, n, ShingleUnit::Char, [&](std::string_view ngram) {
+        ngrams.emplace_back(ngram);
+    });
     return ngrams;
 }
 
@@ -54,4 +92,11 @@ std::vector<std::string> text_to_ngrams_words(const std::vector<std::string>& wo
     return ngrams;
 }
 
+// Word n-grams of `text`, appended to `ngrams` as views into it.
+void text_to_ngram_views(std::string_view text, int n, std::vector<std::string_view>& ngrams) {
+    for_each_shingle(text, n, ShingleUnit::Word, [&](std::string_view ngram) {
+        ngrams.push_back(ngram);
+    });
+}
+
 #endif
\ No newline at end of file
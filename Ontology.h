@@ -0,0 +1,310 @@
+#ifndef ONTOLOGY_H
+#define ONTOLOGY_H
+
+#include "ArrayStorage.h"
+#include "IndexFile.h"
+#include "MappedFile.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <sys/stat.h>
+
+// Ontology snapshot: the IndexFile.h container under its own magic, holding
+//
+//   OntologyArena    every term's ID, label and definition, back to back
+//   OntologyOffsets  uint64_t[3 * numDocs + 1]; term i's ID, label and definition are the arena
+//                    ranges between offsets 3i, 3i + 1, 3i + 2 and 3i + 3
+//   OntologySource   OntologySourceStamp of the JSON file the snapshot was made from
+constexpr char ONTOLOGY_MAGIC[8] = {'O', 'M', 'O', 'N', 'T', 'O', 'L', 'Y'};
+constexpr uint32_t ONTOLOGY_VERSION = 1;
+
+// Size and modification time of a JSON file; a snapshot is used only while they are unchanged.
+struct OntologySourceStamp {
+    uint64_t size;
+    int64_t mtimeNs;
+
+    bool operator==(const OntologySourceStamp& other) const {
+        return size == other.size && mtimeNs == other.mtimeNs;
+    }
+};
+
+static_assert(sizeof(OntologySourceStamp) == 16, "OntologySourceStamp must not contain padding");
+
+bool source_stamp(const std::string& filename, OntologySourceStamp& stamp) {
+    struct stat st;
+    if (::stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+    stamp.size = static_cast<uint64_t>(st.st_size);
+    stamp.mtimeNs = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// The ontology terms (ID, label, definition) in ID order, as parseJson() reads them: IDs with
+// the ENVO_ prefix and IDs without any values are left out, and a definition is the second
+// value of an ID. The strings live in one arena, either filled by streaming the JSON file or
+// mapped from a snapshot.
+class Ontology {
+public:
+    size_t size() const { return offsets.empty() ? 0 : (offsets.size() - 1) / 3; }
+
+    std::string_view id(size_t i) const { return field(3 * i); }
+    std::string_view label(size_t i) const { return field(3 * i + 1); }
+    std::string_view definition(size_t i) const { return field(3 * i + 2); }
+
+    // The label of every term, in ID order, with repeats: what parseJson() returns.
+    std::vector<std::string> labels() const {
+        std::vector<std::string> result;
+        result.reserve(size());
+        for (size_t i = 0; i < size(); ++i) {
+            result.emplace_back(label(i));
+        }
+        return result;
+    }
+
+    // Uses the snapshot at `snapshotPath` if it was made from `jsonPath` as it is now;
+    // otherwise parses `jsonPath` and writes the snapshot for the next run. Without the JSON
+    // file, any snapshot is used.
+    bool load(const std::string& jsonPath, const std::string& snapshotPath) {
+        OntologySourceStamp stamp, snapshotStamp;
+        if (!source_stamp(jsonPath, stamp)) {
+            return loadSnapshot(snapshotPath, nullptr);
+        }
+        if (source_stamp(snapshotPath, snapshotStamp) && loadSnapshot(snapshotPath, &stamp)) {
+            return true;
+        }
+        if (!parse(jsonPath)) {
+            return false;
+        }
+        saveSnapshot(snapshotPath, stamp);
+        return true;
+    }
+
+    // Streams `filename` through a SAX parser, keeping only the first two values of each
+    // term, so no document tree is built and skipped terms are never copied.
+    bool parse(const std::string& filename) {
+        MappedFile file;
+        if (!file.open(filename)) {
+            std::cerr << "Failed to open " << filename << std::endl;
+            return false;
+        }
+        file.advise(MADV_SEQUENTIAL);
+        Loader loader;
+        if (!nlohmann::json::sax_parse(file.data(), file.data() + file.size(), &loader)) {
+            std::cerr << "Failed to parse " << filename << ": " << loader.error << std::endl;
+            return false;
+        }
+        assign(loader);
+        return true;
+    }
+
+    // Maps a snapshot. With `expected`, fails unless the snapshot was made from a JSON file
+    // with that stamp.
+    bool loadSnapshot(const std::string& filename, const OntologySourceStamp* expected) {
+        IndexReader reader;
+        if (!reader.open(filename, true, ONTOLOGY_MAGIC, ONTOLOGY_VERSION)) {
+            return false;
+        }
+        size_t arenaSize, offsetCount, stampCount;
+        const char* arenaData = reader.section<char>(SectionKind::OntologyArena, 0, arenaSize);
+        const uint64_t* offsetData = reader.section<uint64_t>(SectionKind::OntologyOffsets, 0, offsetCount);
+        const OntologySourceStamp* stamp = reader.section<OntologySourceStamp>(SectionKind::OntologySource, 0, stampCount);
+        uint64_t numDocs = reader.getHeader().numDocs;
+        if (!offsetData || !stamp || stampCount != 1 || offsetCount != 3 * numDocs + 1 ||
+            offsetData[0] != 0 || offsetData[offsetCount - 1] != arenaSize ||
+            !std::is_sorted(offsetData, offsetData + offsetCount)) {
+            std::cerr << "Ontology snapshot " << filename << " is malformed" << std::endl;
+            return false;
+        }
+        if (expected && !(*stamp == *expected)) {
+            std::cout << "Ontology snapshot " << filename << " is out of date" << std::endl;
+            return false;
+        }
+        mapping = reader.mapping();
+        arena.attach(arenaData, arenaSize);
+        offsets.attach(offsetData, offsetCount);
+        return true;
+    }
+
+    bool saveSnapshot(const std::string& filename, const OntologySourceStamp& stamp) const {
+        IndexWriter writer;
+        writer.add(SectionKind::OntologyArena, 0, arena.data(), arena.size());
+        writer.add(SectionKind::OntologyOffsets, 0, offsets.data(), offsets.size() * sizeof(uint64_t));
+        writer.add(SectionKind::OntologySource, 0, &stamp, sizeof(stamp));
+        IndexHeader header{};
+        header.numDocs = size();
+        return writer.write(filename, header, ONTOLOGY_MAGIC, ONTOLOGY_VERSION);
+    }
+
+    bool isMapped() const { return mapping != nullptr; }
+
+    size_t memoryUsage() const { return arena.memoryUsage() + offsets.memoryUsage(); }
+
+private:
+    ArrayStorage<char> arena;
+    ArrayStorage<uint64_t> offsets;
+    std::shared_ptr<MappedFile> mapping;
+
+    std::string_view field(size_t slot) const {
+        return std::string_view(arena.data() + offsets[slot], offsets[slot + 1] - offsets[slot]);
+    }
+
+    // Collects the terms in file order. Depth 1 is the top-level object, whose keys are the
+    // IDs; depth 2 is an ID's array of values.
+    struct Loader : nlohmann::json::json_sax_t {
+        struct Record {
+            size_t begin;
+            size_t labelBegin;
+            size_t definitionBegin;
+            size_t end;
+            size_t values;
+            bool hasLabel;
+        };
+
+        std::string strings;
+        std::vector<Record> records;
+        std::string error;
+        int depth = 0;
+        bool keep = false;
+        bool inTerm = false;
+
+        bool null() override { return value(); }
+        bool boolean(bool) override { return value(); }
+        bool number_integer(number_integer_t) override { return value(); }
+        bool number_unsigned(number_unsigned_t) override { return value(); }
+        bool number_float(number_float_t, const string_t&) override { return value(); }
+        bool binary(binary_t&) override { return value(); }
+
+        bool string(string_t& s) override {
+            if (inTerm && depth == 2) {
+                Record& record = records.back();
+                if (record.values == 0) {
+                    strings += s;
+                    record.hasLabel = true;
+                    record.definitionBegin = record.end = strings.size();
+                }
+                else if (record.values == 1) {
+                    strings += s;
+                    record.end = strings.size();
+                }
+            }
+            return value();
+        }
+
+        bool key(string_t& s) override {
+            if (depth == 1) {
+                keep = s.compare(0, 5, "ENVO_") != 0;
+                inTerm = false;
+                if (keep) {
+                    size_t begin = strings.size();
+                    strings += s;
+                    records.push_back(Record{begin, strings.size(), strings.size(), strings.size(), 0, false});
+                }
+            }
+            return true;
+        }
+
+        bool start_object(std::size_t) override {
+            return open(false);
+        }
+
+        bool start_array(std::size_t) override {
+            return open(true);
+        }
+
+        bool end_object() override { return close(); }
+        bool end_array() override { return close(); }
+
+        bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& e) override {
+            error = e.what();
+            return false;
+        }
+
+        // Counts a value of a term's array; a term whose value is not an array, as parseJson()
+        // would reject, is dropped.
+        bool value() {
+            if (depth == 1 && keep) {
+                records.pop_back();
+                keep = false;
+            }
+            if (inTerm && depth == 2) {
+                ++records.back().values;
+            }
+            return true;
+        }
+
+        bool open(bool isArray) {
+            if (depth == 0 && isArray) {
+                error = "the top level is not an object";
+                return false;
+            }
+            if (depth == 1 && keep) {
+                if (isArray) {
+                    inTerm = true;
+                }
+                else {
+                    value();
+                }
+            }
+            else if (depth == 2) {
+                value();
+            }
+            ++depth;
+            return true;
+        }
+
+        bool close() {
+            --depth;
+            if (depth == 1) {
+                inTerm = false;
+                keep = false;
+            }
+            return true;
+        }
+    };
+
+    // Orders the records by ID, keeping the last of repeated IDs, as a parsed document holds
+    // them, and drops the terms without a label.
+    void assign(const Loader& loader) {
+        const auto& records = loader.records;
+        auto idOf = [&](const Loader::Record& r) {
+            return std::string_view(loader.strings.data() + r.begin, r.labelBegin - r.begin);
+        };
+        std::vector<uint32_t> order(records.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return idOf(records[a]) < idOf(records[b]);
+        });
+
+        auto& chars = arena.mutableVector();
+        auto& bounds = offsets.mutableVector();
+        mapping.reset();
+        chars.clear();
+        bounds.assign(1, 0);
+        chars.reserve(loader.strings.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Loader::Record& r = records[order[i]];
+            if (i + 1 < order.size() && idOf(records[order[i + 1]]) == idOf(r)) {
+                continue;
+            }
+            if (!r.hasLabel) {
+                continue;
+            }
+            chars.insert(chars.end(), loader.strings.begin() + r.begin, loader.strings.begin() + r.end);
+            size_t base = chars.size() - (r.end - r.begin);
+            bounds.push_back(base + (r.labelBegin - r.begin));
+            bounds.push_back(base + (r.definitionBegin - r.begin));
+            bounds.push_back(chars.size());
+        }
+        chars.shrink_to_fit();
+    }
+};
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef QUERY_CACHE_H
+#define QUERY_CACHE_H
+
+#include "MinHash.h"
+#include "IndexFile.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Memoized query results, keyed by normalized query text, threshold and k, for one index
+// fingerprint (LSH::fingerprint()). The in-memory tier is a set of independently locked LRU
+// shards bounded by a total entry count. save()/load() add an on-disk tier: a file written
+// for another fingerprint is ignored, so results never outlive the index they came from.
+class QueryCache {
+public:
+    struct Entry {
+        std::vector<std::string> labels;
+        // Similarity per label for ranked (top-k) queries; empty for threshold queries.
+        std::vector<double> scores;
+    };
+
+    explicit QueryCache(uint64_t fingerprint, size_t capacity = size_t(1) << 20)
+        : fingerprint(fingerprint), shardCapacity(std::max<size_t>(1, capacity / NUM_SHARDS)) {}
+
+    static std::string key(std::string_view text, double threshold, size_t k = 0) {
+        std::string result(text);
+        result.push_back('\0');
+        result.append(reinterpret_cast<const char*>(&threshold), sizeof(threshold));
+        uint64_t k64 = k;
+        result.append(reinterpret_cast<const char*>(&k64), sizeof(k64));
+        return result;
+    }
+
+    bool find(const std::string& key, Entry& out) {
+        Shard& shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            ++numMisses;
+            return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        out = it->second->second;
+        ++numHits;
+        return true;
+    }
+
+    void insert(const std::string& key, Entry entry) {
+        Shard& shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            it->second->second = std::move(entry);
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            return;
+        }
+        shard.lru.emplace_front(key, std::move(entry));
+        shard.index.emplace(key, shard.lru.begin());
+        if (shard.lru.size() > shardCapacity) {
+            shard.index.erase(shard.lru.back().first);
+            shard.lru.pop_back();
+        }
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.lru.size();
+        }
+        return total;
+    }
+
+    size_t hits() const { return numHits; }
+    size_t misses() const { return numMisses; }
+
+    // Adds the entries of a file written by save(). Returns false, adding nothing, if the file
+    // is missing, truncated, or belongs to another index.
+    bool load(const std::string& filename) {
+        std::ifstream inFile(filename, std::ios::binary);
+        if (!inFile.is_open()) {
+            return false;
+        }
+        FileHeader header{};
+        inFile.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!inFile || std::memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != CACHE_VERSION) {
+            std::cerr << "Query cache " << filename << " is not a cache file; ignoring it" << std::endl;
+            return false;
+        }
+        if (header.fingerprint != fingerprint) {
+            return false;
+        }
+
+        std::vector<std::pair<std::string, Entry>> entries;
+        entries.reserve(std::min<uint64_t>(header.count, shardCapacity * NUM_SHARDS));
+        for (uint64_t i = 0; i < header.count; ++i) {
+            std::pair<std::string, Entry> entry;
+            uint32_t numLabels = 0;
+            uint8_t hasScores = 0;
+            if (!readString(inFile, entry.first) || !readValue(inFile, numLabels) || !readValue(inFile, hasScores)) {
+                return truncated(filename);
+            }
+            for (uint32_t j = 0; j < numLabels; ++j) {
+                std::string label;
+                double score = 0;
+                if (!readString(inFile, label) || (hasScores && !readValue(inFile, score))) {
+                    return truncated(filename);
+                }
+                entry.second.labels.push_back(std::move(label));
+                if (hasScores) {
+                    entry.second.scores.push_back(score);
+                }
+            }
+            entries.push_back(std::move(entry));
+        }
+
+        for (auto& [key, entry] : entries) {
+            insert(key, std::move(entry));
+        }
+        return true;
+    }
+
+    // Writes every cached entry, least recently used first so that load() restores the order.
+    bool save(const std::string& filename) const {
+        std::string tempname = create_temp_file(filename);
+        if (tempname.empty()) {
+            std::cerr << "Failed to create a temporary file for: " << filename << std::endl;
+            return false;
+        }
+        std::ofstream outFile(tempname, std::ios::binary | std::ios::trunc);
+        if (!outFile.is_open()) {
+            std::cerr << "Failed to open file: " << tempname << std::endl;
+            std::remove(tempname.c_str());
+            return false;
+        }
+
+        // Hold every shard so the entry count in the header matches what follows it.
+        std::vector<std::unique_lock<std::mutex>> locks;
+        FileHeader header{};
+        for (const auto& shard : shards) {
+            locks.emplace_back(shard.mutex);
+            header.count += shard.lru.size();
+        }
+        std::memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+        header.version = CACHE_VERSION;
+        header.fingerprint = fingerprint;
+        outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        for (const auto& shard : shards) {
+            for (auto it = shard.lru.rbegin(); it != shard.lru.rend(); ++it) {
+                const Entry& entry = it->second;
+                writeString(outFile, it->first);
+                writeValue(outFile, static_cast<uint32_t>(entry.labels.size()));
+                writeValue(outFile, static_cast<uint8_t>(!entry.scores.empty()));
+                for (size_t j = 0; j < entry.labels.size(); ++j) {
+                    writeString(outFile, entry.labels[j]);
+                    if (!entry.scores.empty()) {
+                        writeValue(outFile, entry.scores[j]);
+                    }
+                }
+            }
+        }
+
+        outFile.close();
+        if (!outFile.good() || std::rename(tempname.c_str(), filename.c_str()) != 0) {
+            std::cerr << "Failed to write query cache: " << filename << std::endl;
+            std::remove(tempname.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t NUM_SHARDS = 64;
+    static constexpr char CACHE_MAGIC[8] = {'O', 'M', 'Q', 'C', 'A', 'C', 'H', 'E'};
+    static constexpr uint32_t CACHE_VERSION = 1;
+    // Longer strings only come from a damaged file.
+    static constexpr uint32_t MAX_STRING_LENGTH = uint32_t(1) << 24;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t fingerprint;
+        uint64_t count;
+    };
+
+    struct Shard {
+        mutable std::mutex mutex;
+        std::list<std::pair<std::string, Entry>> lru;
+        std::unordered_map<std::string, std::list<std::pair<std::string, Entry>>::iterator> index;
+    };
+
+    uint64_t fingerprint;
+    size_t shardCapacity;
+    Shard shards[NUM_SHARDS];
+    std::atomic<size_t> numHits{0};
+    std::atomic<size_t> numMisses{0};
+
+    Shard& shardOf(const std::string& key) {
+        return shards[hash_bytes(key.data(), key.size(), 0) % NUM_SHARDS];
+    }
+
+    template<typename T>
+    static void writeValue(std::ofstream& out, T value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    static void writeString(std::ofstream& out, const std::string& s) {
+        writeValue(out, static_cast<uint32_t>(s.size()));
+        out.write(s.data(), s.size());
+    }
+
+    template<typename T>
+    static bool readValue(std::ifstream& in, T& value) {
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(value)));
+    }
+
+    static bool readString(std::ifstream& in, std::string& s) {
+        uint32_t length;
+        if (!readValue(in, length) || length > MAX_STRING_LENGTH) {
+            return false;
+        }
+        s.resize(length);
+        return static_cast<bool>(in.read(s.data(), length));
+    }
+
+    static bool truncated(const std::string& filename) {
+        std::cerr << "Query cache " << filename << " is truncated; ignoring it" << std::endl;
+        return false;
+    }
+};
+
+#endif
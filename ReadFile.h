@@ -2,12 +2,18 @@
 #define READFILE_H
 
 #include <nlohmann/json.hpp>
-#include <regex>
 #include <fstream>
 #include <iostream>
-#include "ThreadPool.h"
-#include <unordered_set>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <functional>
+#include <string_view>
+#include "MappedFile.h"
+#include <unordered_map>
 #include <tbb/concurrent_unordered_map.h>
+#include <tbb/parallel_pipeline.h>
+#include <tbb/task_arena.h>
 
 using json = nlohmann::json;
 
@@ -42,177 +48,144 @@ std::vector<std::string> parseJson(json& j, std::unordered_map<std::string, std:
     return res;
 }
 
-std::string clean(const std::string& item) {
-    // Remove numerical values
-    std::string no_numbers = std::regex_replace(item, std::regex("\\d+"), "");
-
-    // Remove any text within parentheses (including the parentheses)
-    std::string no_parentheses = std::regex_replace(no_numbers, std::regex("\\(.*?\\)"), "").erase(0,1);
-
-    return no_parentheses;
+bool isDigits(std::string_view text) {
+    return std::all_of(text.begin(), text.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); });
 }
 
-std::unordered_map<int, std::vector<std::string>> processChunk(const std::vector<std::string>& lines) {
-    std::unordered_map<int, std::vector<std::string>> localDataMap;
-
-    // Set of words to remove from the ingredients
-    std::unordered_set<std::string> word_set = {"about", "all", "any", "as", "bag", "bell", "bottle", "box", "but", "can", "cans",
-                                                "choice", "coarsely", "cubes", "cut", "dry", "extra", "fine", "finely",
-                                                "for", "free", "freshly", "from", "good", "grams", "i", "if", "in", "inch",
-                                                "into", "is", "jar", "lbs", "like", "more", "none", "not", "of", "on", "one",
-                                                "optional", "other", "ounce", "ounces", "pieces", "pinch", "plain", "plus",
-                                                "possibly", "pound", "pounds", "removed", "size", "slices", "stock", "such", "sweet",
-                                                "t", "tablespoon", "tablespoons", "taste", "teaspoons", "the", "thick", "thin", "thinly",
-                                                "to", "up", "use", "very", "weight", "with", "you", "your"};
-
-    for (const auto& line : lines) {
-        std::istringstream lineStream(line);
-        std::string temp, ingredient;
-        int recipeID;
-
-        // Skip the rowID
-        std::getline(lineStream, temp, ',');
-
-        // Read the recipeID
-        std::getline(lineStream, temp, ',');
-        bool flag = false;
-        for (char const &c : temp) {
-            if (!std::isdigit(c)) {
-                flag = true;
-                break;
-            }
-        }
-        if (flag) {
-            continue;
-        }
-        recipeID = std::stoi(temp);
-
-        std::string ingredientsStr;
-        std::getline(lineStream, ingredientsStr);
-        std::istringstream ingredientsStream(ingredientsStr);
-
-        while (std::getline(ingredientsStream, ingredient, ',')) {
-            // ingredient = clean(ingredient);
-            ingredient.erase(std::remove_if(ingredient.begin(), ingredient.end(), ::ispunct), ingredient.end());
-            std::transform(ingredient.begin(), ingredient.end(), ingredient.begin(), ::tolower);
-            std::istringstream wordStream(ingredient);
-            std::string word;
-            std::vector<std::string> cleanedIngredients;
-
-            while (wordStream >> word) {
-                if (word_set.find(word) == word_set.end() && !word.empty()) {
-                    cleanedIngredients.push_back(word);
-                }
-            }
-
-            // If the cleaned ingredient list is not empty, add it to the map
-            if (!cleanedIngredients.empty()) {
-                std::string joinedIngredients = std::accumulate(std::next(cleanedIngredients.begin()), cleanedIngredients.end(), cleanedIngredients[0],
-                                                    [](const std::string& a, const std::string& b) -> std::string { 
-                                                        return a + ' ' + b; 
-                                                    });
-                localDataMap[recipeID].push_back(joinedIngredients);
-            }
-        }
+// One LexMapr candidate row: `recipeID,ingredient,{lexmapr matches}`. The views point into
+// the mapped input file and stay valid until streamCSV() returns.
+struct CandidateRecord {
+    std::string_view line;
+    std::string_view recipeID;
+    std::string_view ingredient;
+    std::string_view lexMapr;
+};
+
+bool parseLexMaprLine(std::string_view line, CandidateRecord& record) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    record.line = line;
+    size_t idEnd = line.find(',');
+    std::string_view id = line.substr(0, idEnd);
+    if (id.empty() || !isDigits(id)) {
+        return false;
+    }
+    record.recipeID = id;
+    if (idEnd == std::string_view::npos) {
+        record.ingredient = std::string_view();
+        record.lexMapr = std::string_view();
+        return true;
     }
 
-    // std::cout << "Finish a chunk" << std::endl;
-    return localDataMap;
+    std::string_view rest = line.substr(idEnd + 1);
+    size_t ingredientEnd = rest.find(',');
+    record.ingredient = rest.substr(0, ingredientEnd);
+    record.lexMapr = ingredientEnd == std::string_view::npos ? std::string_view() : rest.substr(ingredientEnd + 1);
+    return true;
 }
 
-std::unordered_map<std::string, std::vector<std::string>> processLexMaprChunk(const std::vector<std::string>& lines) {
-    std::unordered_map<std::string, std::vector<std::string>> lexMap;
-    for (auto& line : lines) {
-        std::istringstream lineStream(line);
-        std::string id, temp, ingredients, component;
-        std::string recipeID;
-
-        std::getline(lineStream, id, ',');
-        bool flag = false;
-        for (char const &c : id) {
-            if (!std::isdigit(c)) {
-                flag = true;
-                break;
-            }
-        }
-        if (flag) {
-            continue;
-        }
-        recipeID = id;
-        
-        std::getline(lineStream, temp, ',');
-        lexMap[recipeID].push_back(temp);
-
-        std::getline(lineStream, ingredients);
-
-        std::istringstream ingredientStream(ingredients.substr(1, ingredients.length() - 3)); // Remove surrounding brackets
-        while (std::getline(ingredientStream, component, ',')) {
-            // Extract the matching value after the colon, if present
-            size_t pos = component.find(":");
-            if (pos != component.size() - 1) {
-                std::string value = component.substr(pos + 1);
-
-                if (!value.empty() && value.front() == '\'') {
-                    value.erase(0, 1);
-                }
-                if (!value.empty() && value.back() == '\'') {
-                    value.pop_back();
-                }
-                if (!value.empty()) {
-                    lexMap[recipeID].push_back(value);
-                }
-            }
+// Appends the candidate rows of `text`, a run of whole lines, to `records`.
+void parse_candidate_block(std::string_view text, std::vector<CandidateRecord>& records) {
+    CandidateRecord record;
+    while (!text.empty()) {
+        size_t lineEnd = text.find('\n');
+        if (parseLexMaprLine(text.substr(0, lineEnd), record)) {
+            records.push_back(record);
         }
+        text.remove_prefix(lineEnd == std::string_view::npos ? text.size() : lineEnd + 1);
     }
-
-    return lexMap;
 }
 
-
-std::unordered_map<std::string, std::vector<std::string>> processCSV(const std::string& filePath, int mode, size_t linesPerChunk = 1000, size_t numThreads = 12) {
-    std::ifstream file(filePath);
-
-    std::vector<std::future<std::unordered_map<std::string, std::vector<std::string>>>> futures;
-
-    ThreadPool pool(numThreads);
-    std::vector<std::string> buffer;
-    std::string line;
-
-    while (file.good()) {
-
-        for (size_t i = 0; i < linesPerChunk && std::getline(file, line); ++i) {
-            buffer.push_back(line);
-        }
-
-        if (!buffer.empty()) {
-            // std::cout << "Main thread launching a new thread for a chunk" << std::endl;
-            // if (mode == 0) {
-            //     futures.push_back(pool.enqueueTask(processChunk, buffer));
-            // }
-            if (mode == 1) {
-                futures.push_back(pool.enqueueTask(processLexMaprChunk, buffer));
-            }
-            buffer.clear();
-        }
-
+struct CSVStreamOptions {
+    size_t blockSize = size_t(4) << 20;
+    // 0 allows twice as many blocks as worker threads.
+    size_t maxBlocksInFlight = 0;
+    // Keep only the first row of each run of rows sharing a recipe ID. Matching uses one
+    // ingredient per recipe, as the original loader did by keeping the first of a recipe's
+    // rows; the rows of a recipe are expected to be consecutive, as LexMapr writes them.
+    bool firstRowPerRecipe = false;
+    // Parses one block; callers may wrap parse_candidate_block(), e.g. to time it. Called
+    // concurrently for different blocks.
+    std::function<void(std::string_view, std::vector<CandidateRecord>&)> parse = parse_candidate_block;
+};
+
+// Streams a candidates file through `consumer` without loading it: the file is mapped, cut into
+// blocks of about `blockSize` bytes at line boundaries, each block is parsed into records in
+// parallel, and the records of a block are handed to `consumer` (which may run concurrently
+// for different blocks). At most `maxBlocksInFlight` blocks are read ahead of the consumer,
+// so a slow consumer throttles the reader instead of letting parsed input pile up, and the
+// pages of consumed blocks are dropped as they complete.
+template<typename Consumer>
+bool streamCSV(const std::string& filePath, Consumer&& consumer, const CSVStreamOptions& options = {}) {
+    size_t blockSize = options.blockSize;
+    size_t maxBlocksInFlight = options.maxBlocksInFlight;
+    MappedFile file;
+    if (!file.open(filePath)) {
+        std::cerr << "Failed to open " << filePath << std::endl;
+        return false;
     }
-
-    file.close();
-
-    std::cout << "Finished ingredient chunk processing." << std::endl;
-
-    std::unordered_map<std::string, std::vector<std::string>> globalDataMap;
-
-    // Merge local maps from each thread
-    for (auto& fut : futures) {
-        auto localMap = fut.get();
-        for (const auto& pair : localMap) {
-            globalDataMap[pair.first] = pair.second;
-        }
+    file.advise(MADV_SEQUENTIAL);
+    if (maxBlocksInFlight == 0) {
+        maxBlocksInFlight = 2 * static_cast<size_t>(tbb::this_task_arena::max_concurrency());
     }
 
-    std::cout << "Finished ingredient data map with size = " << globalDataMap.size() << std::endl;
-    return globalDataMap;
+    struct Block {
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    const char* data = file.data();
+    const size_t size = file.size();
+    size_t position = 0;
+    // Copied: its block may be released before the next block reaches the filter.
+    std::string lastRecipe;
+    bool haveLastRecipe = false;
+    using Parsed = std::pair<Block, std::vector<CandidateRecord>>;
+
+    tbb::parallel_pipeline(maxBlocksInFlight,
+        tbb::make_filter<void, Block>(tbb::filter_mode::serial_in_order, [&](tbb::flow_control& fc) -> Block {
+            if (position >= size) {
+                fc.stop();
+                return Block{};
+            }
+            size_t end = std::min(position + blockSize, size);
+            const void* newline = end < size ? std::memchr(data + end, '\n', size - end) : nullptr;
+            end = newline ? static_cast<const char*>(newline) - data + 1 : size;
+            Block block{position, end};
+            position = end;
+            return block;
+        }) &
+        tbb::make_filter<Block, Parsed>(tbb::filter_mode::parallel, [&](Block block) {
+            std::vector<CandidateRecord> records;
+            options.parse(std::string_view(data + block.begin, block.end - block.begin), records);
+            return std::make_pair(block, std::move(records));
+        }) &
+        tbb::make_filter<Parsed, Parsed>(tbb::filter_mode::serial_in_order, [&](Parsed parsed) {
+            if (options.firstRowPerRecipe) {
+                auto& records = parsed.second;
+                size_t kept = 0;
+                for (size_t i = 0; i < records.size(); ++i) {
+                    bool repeated = kept > 0 ? records[i].recipeID == records[kept - 1].recipeID
+                                             : haveLastRecipe && records[i].recipeID == lastRecipe;
+                    if (!repeated) {
+                        records[kept++] = records[i];
+                    }
+                }
+                records.resize(kept);
+                if (kept > 0) {
+                    lastRecipe.assign(records.back().recipeID);
+                    haveLastRecipe = true;
+                }
+            }
+            return parsed;
+        }) &
+        tbb::make_filter<Parsed, void>(tbb::filter_mode::parallel, [&](const Parsed& parsed) {
+            consumer(parsed.second);
+            file.release(parsed.first.begin, parsed.first.end - parsed.first.begin);
+        }));
+
+    return true;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,212 @@
+#ifndef RESULT_WRITER_H
+#define RESULT_WRITER_H
+
+#include <nlohmann/json.hpp>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Output formats of match(). Text is the original layout: the recipe ID on one line and its
+// "(ontology ID definition[ score]), " entries on the next. JSON Lines writes one object per
+// recipe. Binary writes integer IDs only, indexing a sidecar dictionary [output].dict.json:
+//
+//   header  {char magic[8] = "OMMATCH1"; uint32_t version = 1; uint32_t flags (bit 0: scores)}
+//   record  {uint32_t recipe; uint32_t count; count x {uint32_t term[, float score]}}
+//
+// with recipe and term indexing the dictionary's "recipes" and "terms" arrays.
+enum class OutputFormat { Text, JsonLines, Binary };
+
+bool parse_output_format(const std::string& name, OutputFormat& format) {
+    if (name == "text") {
+        format = OutputFormat::Text;
+    }
+    else if (name == "jsonl") {
+        format = OutputFormat::JsonLines;
+    }
+    else if (name == "binary") {
+        format = OutputFormat::Binary;
+    }
+    else {
+        std::cerr << "Unknown output format " << name << " (expected text, jsonl or binary)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+struct OntologyTerm {
+    std::string id;
+    std::string label;
+    std::string definition;
+};
+
+// One recipe's matches as indexes into the term table, with a score per term for ranked
+// (top-k) output.
+struct RecipeMatches {
+    uint64_t recipe;
+    uint32_t recipeIndex;
+    std::vector<uint32_t> terms;
+    std::vector<double> scores;
+};
+
+// Formats blocks of recipes independently, so blocks can be formatted in parallel, and writes
+// the formatted chunks in order with one write() each.
+class ResultWriter {
+public:
+    ResultWriter(std::string path, OutputFormat format, const std::vector<OntologyTerm>& terms, bool ranked)
+        : path(std::move(path)), format(format), terms(terms), ranked(ranked) {}
+
+    ResultWriter(const ResultWriter&) = delete;
+    ResultWriter& operator=(const ResultWriter&) = delete;
+
+    ~ResultWriter() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    bool open() {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Failed to open " << path << std::endl;
+            return false;
+        }
+        if (format == OutputFormat::Binary) {
+            std::string header("OMMATCH1", 8);
+            appendValue(header, uint32_t(1));
+            appendValue(header, uint32_t(ranked ? 1 : 0));
+            return write(header);
+        }
+        return true;
+    }
+
+    void formatBlock(const std::vector<RecipeMatches>& block, std::string& out) const {
+        for (const RecipeMatches& recipe : block) {
+            switch (format) {
+            case OutputFormat::Text:
+                formatText(recipe, out);
+                break;
+            case OutputFormat::JsonLines:
+                formatJson(recipe, out);
+                break;
+            case OutputFormat::Binary:
+                formatBinary(recipe, out);
+                break;
+            }
+        }
+    }
+
+    bool write(const std::string& chunk) {
+        const char* data = chunk.data();
+        size_t size = chunk.size();
+        while (size > 0) {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                std::cerr << "Failed to write " << path << ": " << std::strerror(errno) << std::endl;
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    // Closes the output; for the binary format also writes the dictionary, whose "recipes"
+    // array is `recipes` in recipeIndex order.
+    bool finish(const std::vector<uint64_t>& recipes) {
+        bool ok = ::close(fd) == 0;
+        fd = -1;
+        if (format != OutputFormat::Binary) {
+            return ok;
+        }
+        nlohmann::json dictionary;
+        dictionary["recipes"] = nlohmann::json::array();
+        for (uint64_t recipe : recipes) {
+            dictionary["recipes"].push_back(std::to_string(recipe));
+        }
+        dictionary["terms"] = nlohmann::json::array();
+        for (const OntologyTerm& term : terms) {
+            dictionary["terms"].push_back({{"id", term.id}, {"label", term.label}, {"definition", term.definition}});
+        }
+        std::ofstream dictFile(path + ".dict.json");
+        if (!dictFile.is_open()) {
+            std::cerr << "Failed to open " << path << ".dict.json" << std::endl;
+            return false;
+        }
+        dictFile << dictionary.dump() << "\n";
+        return ok && dictFile.good();
+    }
+
+private:
+    std::string path;
+    OutputFormat format;
+    const std::vector<OntologyTerm>& terms;
+    bool ranked;
+    int fd = -1;
+
+    template<typename T>
+    static void appendValue(std::string& out, T value) {
+        out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void formatText(const RecipeMatches& recipe, std::string& out) const {
+        char id[24];
+        out.append(id, std::to_chars(id, id + sizeof(id), recipe.recipe).ptr);
+        out.push_back('\n');
+        char score[32];
+        for (size_t i = 0; i < recipe.terms.size(); ++i) {
+            const OntologyTerm& term = terms[recipe.terms[i]];
+            out.push_back('(');
+            out.append(term.id);
+            out.push_back(' ');
+            out.append(term.definition);
+            if (ranked) {
+                // %g matches the default precision of the iostream output this replaces.
+                std::snprintf(score, sizeof(score), " %g", recipe.scores[i]);
+                out.append(score);
+            }
+            out.append("), ");
+        }
+        out.push_back('\n');
+    }
+
+    void formatJson(const RecipeMatches& recipe, std::string& out) const {
+        nlohmann::json line;
+        line["recipe"] = std::to_string(recipe.recipe);
+        line["matches"] = nlohmann::json::array();
+        for (size_t i = 0; i < recipe.terms.size(); ++i) {
+            const OntologyTerm& term = terms[recipe.terms[i]];
+            nlohmann::json match = {{"id", term.id}, {"label", term.label}};
+            if (ranked) {
+                match["score"] = recipe.scores[i];
+            }
+            line["matches"].push_back(std::move(match));
+        }
+        out.append(line.dump());
+        out.push_back('\n');
+    }
+
+    void formatBinary(const RecipeMatches& recipe, std::string& out) const {
+        appendValue(out, recipe.recipeIndex);
+        appendValue(out, static_cast<uint32_t>(recipe.terms.size()));
+        for (size_t i = 0; i < recipe.terms.size(); ++i) {
+            appendValue(out, recipe.terms[i]);
+            if (ranked) {
+                appendValue(out, static_cast<float>(recipe.scores[i]));
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,416 @@
+#ifndef SHARDED_INDEX_H
+#define SHARDED_INDEX_H
+
+#include "LSH.h"
+#include "Wire.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <tbb/parallel_for.h>
+
+// An index partitioned by document ID over worker processes. Global document IDs number the
+// distinct ontology terms in order of first appearance (distinct_terms()); shard i of n holds
+// the IDs congruent to i mod n in its own LSH and serves them over a Unix domain socket
+// (ShardServer). A ShardCoordinator sends every query batch to all shards, and merges their
+// replies, which carry global IDs. Only the socket paths tie the two together, so workers can
+// run wherever those paths can be reached.
+
+enum class ShardMessage : uint8_t {
+    Info = 1,       // -> {uint64_t fingerprint, uint64_t documents}
+    QueryBatch = 2, // {int32_t probes, uint32_t count, count x {double threshold, string}} -> per query {uint32_t n, n x uint32_t id}
+    TopKBatch = 3,  // {int32_t probes, uint64_t k, uint32_t count, count x {double, string}} -> per query {uint32_t n, n x {uint32_t id, double score}}
+    Shutdown = 4,   // -> empty; the worker exits after replying
+    Reply = 5,
+    Error = 6,      // {string message}
+};
+
+std::vector<std::string> distinct_terms(const std::vector<std::string>& terms) {
+    std::vector<std::string> result;
+    std::unordered_set<std::string_view> seen;
+    for (const auto& term : terms) {
+        if (seen.insert(term).second) {
+            result.push_back(term);
+        }
+    }
+    return result;
+}
+
+class ShardServer {
+public:
+    // `globalIDs[id]` is the global ID of the document `lsh` knows as `id`.
+    ShardServer(LSH& lsh, std::vector<uint32_t> globalIDs) : lsh(lsh), globalIDs(std::move(globalIDs)) {
+        for (uint32_t id = 0; id < this->globalIDs.size(); ++id) {
+            localIDs.emplace(lsh.docLabel(id), id);
+        }
+    }
+
+    // Serves one connection at a time until a Shutdown request arrives. Returns false if the
+    // socket could not be opened.
+    bool serve(const std::string& socketPath) {
+        int listener = listen_unix(socketPath);
+        if (listener < 0) {
+            return false;
+        }
+        bool running = true;
+        while (running) {
+            int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Failed to accept on " << socketPath << ": " << std::strerror(errno) << std::endl;
+                break;
+            }
+            running = handle(fd);
+            ::close(fd);
+        }
+        ::close(listener);
+        ::unlink(socketPath.c_str());
+        return true;
+    }
+
+private:
+    LSH& lsh;
+    std::vector<uint32_t> globalIDs;
+    std::unordered_map<std::string_view, uint32_t> localIDs;
+
+    // Answers requests on `fd` until the peer hangs up (returns true) or asks to shut down
+    // (returns false).
+    bool handle(int fd) {
+        uint8_t type;
+        std::vector<char> payload;
+        WireWriter reply;
+        while (read_frame(fd, type, payload)) {
+            reply.clear();
+            WireReader request(payload);
+            bool ok = true;
+            switch (static_cast<ShardMessage>(type)) {
+            case ShardMessage::Info:
+                reply.put(lsh.fingerprint());
+                reply.put(static_cast<uint64_t>(lsh.size()));
+                break;
+            case ShardMessage::QueryBatch:
+                ok = queryBatch(request, reply);
+                break;
+            case ShardMessage::TopKBatch:
+                ok = topkBatch(request, reply);
+                break;
+            case ShardMessage::Shutdown:
+                write_frame(fd, static_cast<uint8_t>(ShardMessage::Reply), reply.bytes());
+                return false;
+            default:
+                ok = false;
+                break;
+            }
+            if (!ok) {
+                reply.clear();
+                reply.putString("malformed request");
+            }
+            if (!write_frame(fd, static_cast<uint8_t>(ok ? ShardMessage::Reply : ShardMessage::Error), reply.bytes())) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    static bool readQueries(WireReader& request, std::vector<std::string>& queries, std::vector<double>& thresholds) {
+        uint32_t count;
+        if (!request.get(count)) {
+            return false;
+        }
+        queries.resize(count);
+        thresholds.resize(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!request.get(thresholds[i]) || !request.getString(queries[i])) {
+                return false;
+            }
+        }
+        return request.done();
+    }
+
+    bool queryBatch(WireReader& request, WireWriter& reply) {
+        int32_t probes;
+        std::vector<std::string> queries;
+        std::vector<double> thresholds;
+        if (!request.get(probes) || !readQueries(request, queries, thresholds)) {
+            return false;
+        }
+        for (auto& ids : lsh.query_batch(queries, thresholds, probes)) {
+            for (uint32_t& id : ids) {
+                id = globalIDs[id];
+            }
+            std::sort(ids.begin(), ids.end());
+            reply.put(static_cast<uint32_t>(ids.size()));
+            for (uint32_t id : ids) {
+                reply.put(id);
+            }
+        }
+        return true;
+    }
+
+    bool topkBatch(WireReader& request, WireWriter& reply) {
+        int32_t probes;
+        uint64_t k;
+        std::vector<std::string> queries;
+        std::vector<double> thresholds;
+        if (!request.get(probes) || !request.get(k) || !readQueries(request, queries, thresholds)) {
+            return false;
+        }
+        std::vector<std::vector<std::pair<std::string, double>>> ranked(queries.size());
+        tbb::parallel_for(size_t(0), queries.size(), [&](size_t i) {
+            ranked[i] = lsh.query_topk(queries[i], k, thresholds[i], probes);
+        });
+        for (const auto& list : ranked) {
+            reply.put(static_cast<uint32_t>(list.size()));
+            for (const auto& [label, score] : list) {
+                reply.put(globalIDs[localIDs.at(label)]);
+                reply.put(score);
+            }
+        }
+        return true;
+    }
+};
+
+class ShardCoordinator {
+public:
+    // `terms` are the distinct terms that global IDs index.
+    explicit ShardCoordinator(std::vector<std::string> terms) : terms(std::move(terms)) {}
+
+    ShardCoordinator(const ShardCoordinator&) = delete;
+    ShardCoordinator& operator=(const ShardCoordinator&) = delete;
+
+    ~ShardCoordinator() {
+        shutdown();
+    }
+
+    // Connects to one worker per path, waiting up to `timeoutMs` for each to start listening,
+    // and asks each for its index fingerprint.
+    bool connect(const std::vector<std::string>& socketPaths, int timeoutMs = 600000) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& path : socketPaths) {
+            int fd = connect_unix(path, timeoutMs);
+            if (fd < 0) {
+                return false;
+            }
+            shards.push_back(fd);
+        }
+        WireWriter request;
+        std::vector<std::vector<char>> replies;
+        if (!roundTrip(ShardMessage::Info, request, replies)) {
+            return false;
+        }
+        combinedFingerprint = mix64(shards.size());
+        for (const auto& payload : replies) {
+            WireReader reply(payload);
+            uint64_t shardFingerprint = 0, documents = 0;
+            reply.get(shardFingerprint);
+            reply.get(documents);
+            combinedFingerprint = mix64(combinedFingerprint ^ shardFingerprint);
+        }
+        return true;
+    }
+
+    // Makes shutdown() also reap this worker process.
+    void adopt(pid_t pid) {
+        children.push_back(pid);
+    }
+
+    // IDs of the documents, over all shards, matching each query at its threshold, ascending.
+    // Returns false if any shard failed to answer.
+    bool query_batch(const std::vector<std::string>& queries, const std::vector<double>& thresholds, int probes,
+                     std::vector<std::vector<uint32_t>>& results) {
+        WireWriter request;
+        request.put(static_cast<int32_t>(probes));
+        putQueries(request, queries, thresholds);
+        std::vector<std::vector<char>> replies;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!roundTrip(ShardMessage::QueryBatch, request, replies)) {
+                return false;
+            }
+        }
+
+        results.assign(queries.size(), {});
+        for (const auto& payload : replies) {
+            WireReader reply(payload);
+            for (auto& result : results) {
+                uint32_t count, id;
+                if (!reply.get(count)) {
+                    return malformed();
+                }
+                for (uint32_t j = 0; j < count; ++j) {
+                    if (!reply.get(id)) {
+                        return malformed();
+                    }
+                    result.push_back(id);
+                }
+            }
+        }
+        for (auto& result : results) {
+            std::sort(result.begin(), result.end());
+        }
+        return true;
+    }
+
+    // The k best (global ID, similarity) pairs per query over all shards, best first.
+    bool query_topk_batch(const std::vector<std::string>& queries, const std::vector<double>& thresholds, size_t k,
+                          int probes, std::vector<std::vector<std::pair<uint32_t, double>>>& results) {
+        WireWriter request;
+        request.put(static_cast<int32_t>(probes));
+        request.put(static_cast<uint64_t>(k));
+        putQueries(request, queries, thresholds);
+        std::vector<std::vector<char>> replies;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!roundTrip(ShardMessage::TopKBatch, request, replies)) {
+                return false;
+            }
+        }
+
+        results.assign(queries.size(), {});
+        for (const auto& payload : replies) {
+            WireReader reply(payload);
+            for (auto& result : results) {
+                uint32_t count, id;
+                double score;
+                if (!reply.get(count)) {
+                    return malformed();
+                }
+                for (uint32_t j = 0; j < count; ++j) {
+                    if (!reply.get(id) || !reply.get(score)) {
+                        return malformed();
+                    }
+                    result.emplace_back(id, score);
+                }
+            }
+        }
+        for (auto& result : results) {
+            std::sort(result.begin(), result.end(), [&](const auto& a, const auto& b) {
+                return a.second != b.second ? a.second > b.second : terms[a.first] < terms[b.first];
+            });
+            result.resize(std::min(result.size(), k));
+        }
+        return true;
+    }
+
+    std::string_view docLabel(uint32_t id) const { return terms[id]; }
+
+    // Changes whenever any shard's index does, for keying cached results.
+    uint64_t fingerprint() const { return combinedFingerprint; }
+
+    size_t numShards() const { return shards.size(); }
+
+    // Asks every connected worker to exit, closes the connections and reaps adopted processes.
+    // A worker that has not exited within `timeoutMs`, because it never connected, lost its
+    // connection or hangs, is killed.
+    void shutdown(int timeoutMs = 5000) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int fd : shards) {
+            uint8_t type;
+            std::vector<char> payload;
+            if (write_frame(fd, static_cast<uint8_t>(ShardMessage::Shutdown), {})) {
+                read_frame(fd, type, payload);
+            }
+            ::close(fd);
+        }
+        shards.clear();
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+        while (!children.empty()) {
+            int status;
+            children.erase(std::remove_if(children.begin(), children.end(), [&](pid_t pid) {
+                return ::waitpid(pid, &status, WNOHANG) != 0;
+            }), children.end());
+            if (children.empty() || std::chrono::steady_clock::now() >= deadline) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        for (pid_t pid : children) {
+            int status;
+            std::cerr << "Shard worker " << pid << " did not exit; killing it" << std::endl;
+            ::kill(pid, SIGKILL);
+            ::waitpid(pid, &status, 0);
+        }
+        children.clear();
+    }
+
+private:
+    std::vector<std::string> terms;
+    std::vector<int> shards;
+    std::vector<pid_t> children;
+    uint64_t combinedFingerprint = 0;
+    // One batch at a time is in flight on the shard connections.
+    std::mutex mutex;
+
+    static void putQueries(WireWriter& request, const std::vector<std::string>& queries,
+                           const std::vector<double>& thresholds) {
+        request.put(static_cast<uint32_t>(queries.size()));
+        for (size_t i = 0; i < queries.size(); ++i) {
+            request.put(thresholds[i]);
+            request.putString(queries[i]);
+        }
+    }
+
+    // Scatters one request to every shard, then gathers the replies in shard order. Workers
+    // read a whole request before replying, so writing all requests first cannot deadlock.
+    // The caller holds `mutex`.
+    bool roundTrip(ShardMessage type, const WireWriter& request, std::vector<std::vector<char>>& replies) {
+        for (size_t i = 0; i < shards.size(); ++i) {
+            if (!write_frame(shards[i], static_cast<uint8_t>(type), request.bytes())) {
+                std::cerr << "Lost connection to shard " << i << std::endl;
+                return false;
+            }
+        }
+        replies.assign(shards.size(), {});
+        for (size_t i = 0; i < shards.size(); ++i) {
+            uint8_t replyType;
+            if (!read_frame(shards[i], replyType, replies[i])) {
+                std::cerr << "Lost connection to shard " << i << std::endl;
+                return false;
+            }
+            if (replyType != static_cast<uint8_t>(ShardMessage::Reply)) {
+                std::string message;
+                WireReader(replies[i]).getString(message);
+                std::cerr << "Shard " << i << " failed: " << message << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool malformed() {
+        std::cerr << "Malformed reply from a shard" << std::endl;
+        return false;
+    }
+};
+
+// Starts `program` with arguments `args` (args[0] is its name) as a child process. Returns its
+// pid, or -1.
+pid_t spawn_process(const std::string& program, const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    int error = posix_spawn(&pid, program.c_str(), nullptr, nullptr, argv.data(), environ);
+    if (error != 0) {
+        std::cerr << "Failed to start " << program << ": " << std::strerror(error) << std::endl;
+        return -1;
+    }
+    return pid;
+}
+
+#endif
@@ -0,0 +1,236 @@
+#ifndef SIGNATURE_MATRIX_H
+#define SIGNATURE_MATRIX_H
+
+#include "ArrayStorage.h"
+#include <immintrin.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// Allocator returning cache-line aligned storage, so packed rows start on a 64-byte boundary.
+template<typename T, size_t Alignment = 64>
+struct AlignedAllocator {
+    using value_type = T;
+
+    template<typename U>
+    struct rebind { using other = AlignedAllocator<U, Alignment>; };
+
+    AlignedAllocator() = default;
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    // Through the aligned operator new, so replacements of it (AllocationCounter.cpp) see these.
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T* p, size_t) { ::operator delete(p, std::align_val_t(Alignment)); }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+using AlignedWords = std::vector<uint64_t, AlignedAllocator<uint64_t>>;
+
+// Counts slots whose b-bit values differ between two packed rows of `words` 64-bit words.
+// XOR marks differing bits, the shift/or folds every slot onto its lowest bit, and `lowBits`
+// keeps one bit per slot so a popcount yields the number of mismatching slots.
+using MismatchKernel = size_t (*)(const uint64_t*, const uint64_t*, size_t, int, uint64_t);
+
+size_t mismatches_scalar(const uint64_t* a, const uint64_t* b, size_t words, int bits, uint64_t lowBits) {
+    size_t count = 0;
+    for (size_t i = 0; i < words; ++i) {
+        uint64_t x = a[i] ^ b[i];
+        for (int s = 1; s < bits; s <<= 1) {
+            x |= x >> s;
+        }
+        count += __builtin_popcountll(x & lowBits);
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+size_t mismatches_avx2(const uint64_t* a, const uint64_t* b, size_t words, int bits, uint64_t lowBits) {
+    const __m256i mask = _mm256_set1_epi64x(static_cast<long long>(lowBits));
+    const __m256i nibbleCounts = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                  0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowNibble = _mm256_set1_epi8(0x0F);
+    __m256i total = _mm256_setzero_si256();
+
+    for (size_t i = 0; i < words; i += 4) {
+        __m256i x = _mm256_xor_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(a + i)),
+                                     _mm256_load_si256(reinterpret_cast<const __m256i*>(b + i)));
+        for (int s = 1; s < bits; s <<= 1) {
+            x = _mm256_or_si256(x, _mm256_srl_epi64(x, _mm_cvtsi32_si128(s)));
+        }
+        x = _mm256_and_si256(x, mask);
+
+        __m256i lo = _mm256_shuffle_epi8(nibbleCounts, _mm256_and_si256(x, lowNibble));
+        __m256i hi = _mm256_shuffle_epi8(nibbleCounts, _mm256_and_si256(_mm256_srli_epi16(x, 4), lowNibble));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+
+    return static_cast<size_t>(_mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                               _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3));
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+size_t mismatches_avx512(const uint64_t* a, const uint64_t* b, size_t words, int bits, uint64_t lowBits) {
+    const __m512i mask = _mm512_set1_epi64(static_cast<long long>(lowBits));
+    __m512i total = _mm512_setzero_si512();
+
+    for (size_t i = 0; i < words; i += 8) {
+        __m512i x = _mm512_xor_si512(_mm512_load_si512(a + i), _mm512_load_si512(b + i));
+        for (int s = 1; s < bits; s <<= 1) {
+            // The zero-masked form: the plain one starts from an undefined vector, which GCC
+            // reports as maybe-uninitialized.
+            x = _mm512_or_si512(x, _mm512_maskz_srl_epi64(__mmask8(0xFF), x, _mm_cvtsi32_si128(s)));
+        }
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_and_si512(x, mask)));
+    }
+
+    alignas(64) uint64_t lanes[8];
+    _mm512_store_si512(lanes, total);
+    return static_cast<size_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7]);
+}
+
+MismatchKernel select_mismatch_kernel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+        return mismatches_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return mismatches_avx2;
+    }
+    return mismatches_scalar;
+}
+
+// Contiguous matrix of b-bit minwise signatures (Li & Koenig, "b-Bit Minwise Hashing").
+// Each row keeps only the lowest b bits of every min-hash slot, packed into 64-bit words and
+// padded to a whole cache line so the SIMD kernels never need a scalar tail.
+class SignatureMatrix {
+public:
+    SignatureMatrix(int numHashes = 100, int bits = 16) : numHashes(numHashes), bits(bits) {
+        if (bits != 1 && bits != 2 && bits != 4 && bits != 8 && bits != 16) {
+            throw std::invalid_argument("b-bit signatures support 1, 2, 4, 8 or 16 bits per slot");
+        }
+        size_t slotsPerWord = 64 / bits;
+        words = (numHashes + slotsPerWord - 1) / slotsPerWord;
+        words = (words + 7) / 8 * 8;
+
+        lowBits = 0;
+        for (size_t i = 0; i < slotsPerWord; ++i) {
+            lowBits |= uint64_t(1) << (i * bits);
+        }
+        collisionFloor = 1.0 / static_cast<double>(uint64_t(1) << bits);
+        kernel = select_mismatch_kernel();
+    }
+
+    int bitsPerSlot() const { return bits; }
+    int numSlots() const { return numHashes; }
+    size_t wordsPerRow() const { return words; }
+    size_t rows() const { return numRows; }
+    size_t memoryUsage() const { return data.memoryUsage(); }
+
+    // Writes the packed b-bit form of a full signature into `out` (wordsPerRow() words).
+    void pack(const std::vector<unsigned long>& signature, uint64_t* out) const {
+        std::fill(out, out + words, 0);
+        const uint64_t slotMask = (uint64_t(1) << bits) - 1;
+        const size_t slotsPerWord = 64 / bits;
+        for (int i = 0; i < numHashes; ++i) {
+            out[i / slotsPerWord] |= (static_cast<uint64_t>(signature[i]) & slotMask) << ((i % slotsPerWord) * bits);
+        }
+    }
+
+    AlignedWords pack(const std::vector<unsigned long>& signature) const {
+        AlignedWords row(words);
+        pack(signature, row.data());
+        return row;
+    }
+
+    // Appends a packed row and returns its index. Not thread-safe; callers serialize growth.
+    uint32_t append(const uint64_t* packedRow) {
+        auto& storage = data.mutableVector();
+        if ((numRows + 1) * words > storage.size()) {
+            storage.resize(std::max(storage.size() * 2, (numRows + 1) * words));
+        }
+        std::memcpy(&storage[numRows * words], packedRow, words * sizeof(uint64_t));
+        return static_cast<uint32_t>(numRows++);
+    }
+
+    // Sets the number of rows; new rows are zero. Not thread-safe, but afterwards set() may be
+    // called concurrently for distinct rows.
+    void resize(size_t count) {
+        auto& storage = data.mutableVector();
+        if (count * words > storage.size()) {
+            storage.resize(count * words);
+        }
+        numRows = count;
+    }
+
+    void set(uint32_t row, const uint64_t* packedRow) {
+        std::memcpy(&data.mutableVector()[static_cast<size_t>(row) * words], packedRow, words * sizeof(uint64_t));
+    }
+
+    const uint64_t* row(uint32_t r) const {
+        return data.data() + static_cast<size_t>(r) * words;
+    }
+
+    // All rows back to back; rows() * wordsPerRow() words.
+    const uint64_t* rowData() const { return data.data(); }
+
+    // Serves `count` rows straight from external memory laid out like rowData().
+    void attach(const uint64_t* rows, size_t count) {
+        data.attach(rows, count * words);
+        numRows = count;
+    }
+
+    void clear() {
+        data.mutableVector().clear();
+        numRows = 0;
+    }
+
+    size_t matches(const uint64_t* a, const uint64_t* b) const {
+        return numHashes - kernel(a, b, words, bits, lowBits);
+    }
+
+    // Unbiased Jaccard estimate from the fraction of equal b-bit slots. Two unrelated slots
+    // still agree with probability 2^-b, so P(match) = C + (1 - C) * J with C = 2^-b.
+    double estimate(size_t matchCount) const {
+        double p = static_cast<double>(matchCount) / numHashes;
+        double j = (p - collisionFloor) / (1.0 - collisionFloor);
+        return std::clamp(j, 0.0, 1.0);
+    }
+
+    // Smallest number of equal slots whose estimate reaches `threshold`. The expected count is
+    // rounded to the nearest whole slot: estimates are quantized to 1/k, and for wide b the
+    // correction is a fraction of a slot that would otherwise flip pairs sitting exactly on
+    // the threshold.
+    size_t requiredMatches(double threshold) const {
+        double expected = numHashes * (collisionFloor + (1.0 - collisionFloor) * threshold);
+        return static_cast<size_t>(std::max(0.0, std::ceil(expected - 0.5)));
+    }
+
+    double similarity(const uint64_t* packedQuery, uint32_t r) const {
+        return estimate(matches(packedQuery, row(r)));
+    }
+
+private:
+    int numHashes;
+    int bits;
+    size_t words;
+    uint64_t lowBits;
+    double collisionFloor;
+    MismatchKernel kernel;
+    ArrayStorage<uint64_t, AlignedAllocator<uint64_t>> data;
+    size_t numRows = 0;
+};
+
+#endif
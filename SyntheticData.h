@@ -0,0 +1,149 @@
+#ifndef SYNTHETIC_DATA_H
+#define SYNTHETIC_DATA_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+struct SyntheticOptions {
+    size_t numTerms = 10000;
+    size_t numCandidates = 50000;
+    size_t vocabularySize = 5000;
+    int maxWordsPerTerm = 4;
+    // Zipf exponent of word frequencies; 0 draws every word equally often.
+    double skew = 1.0;
+    // Fraction of candidates that copy an ontology term (possibly with a word dropped or
+    // added), so queries find matches at a realistic rate.
+    double overlap = 0.5;
+    uint64_t seed = 42;
+};
+
+// Deterministic generator of ontology terms and candidate ingredient phrases drawn from a
+// shared made-up vocabulary, written in the formats match() reads.
+class SyntheticGenerator {
+public:
+    explicit SyntheticGenerator(const SyntheticOptions& options) : options(options), rng(options.seed) {
+        static const char* syllables[] = {"ba", "ko", "ri", "me", "tu", "sa", "ne", "lo", "pi", "da",
+                                          "fe", "gu", "ha", "ji", "ku", "ma", "no", "ra", "si", "te"};
+        std::mt19937_64 wordRng(options.seed ^ 0x9E3779B97F4A7C15ULL);
+        for (size_t i = 0; i < options.vocabularySize; ++i) {
+            // Syllables encode the index, so every word is distinct; a random tail varies lengths.
+            std::string word;
+            size_t n = i;
+            do {
+                word += syllables[n % 20];
+                n /= 20;
+            } while (n > 0);
+            for (size_t extra = wordRng() % 3; extra > 0; --extra) {
+                word += syllables[wordRng() % 20];
+            }
+            vocabulary.push_back(word);
+        }
+
+        cumulative.resize(vocabulary.size());
+        double total = 0;
+        for (size_t rank = 0; rank < vocabulary.size(); ++rank) {
+            total += 1.0 / std::pow(static_cast<double>(rank + 1), options.skew);
+            cumulative[rank] = total;
+        }
+    }
+
+    const std::vector<std::string>& terms() {
+        if (termList.empty()) {
+            for (size_t i = 0; i < options.numTerms; ++i) {
+                termList.push_back(phrase(1 + rng() % options.maxWordsPerTerm));
+            }
+        }
+        return termList;
+    }
+
+    std::vector<std::string> candidates() {
+        const auto& source = terms();
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        std::vector<std::string> result;
+        result.reserve(options.numCandidates);
+        for (size_t i = 0; i < options.numCandidates; ++i) {
+            if (source.empty() || unit(rng) >= options.overlap) {
+                result.push_back(phrase(1 + rng() % options.maxWordsPerTerm));
+                continue;
+            }
+            std::string text = source[rng() % source.size()];
+            switch (rng() % 3) {
+            case 0:
+                text += " " + word();
+                break;
+            case 1: {
+                size_t space = text.rfind(' ');
+                if (space != std::string::npos) {
+                    text.resize(space);
+                }
+                break;
+            }
+            default:
+                break;
+            }
+            result.push_back(std::move(text));
+        }
+        return result;
+    }
+
+    // Writes the terms as the JSON produced by ProcessOntology.py: id -> [label, definition].
+    bool writeOntology(const std::string& filename) {
+        std::ofstream outFile(filename);
+        if (!outFile.is_open()) {
+            std::cerr << "Failed to open " << filename << std::endl;
+            return false;
+        }
+        const auto& list = terms();
+        outFile << "{";
+        for (size_t i = 0; i < list.size(); ++i) {
+            outFile << (i == 0 ? "" : ", ") << "\"FOODON_" << i << "\": [\"" << list[i] << "\", \"definition of "
+                    << list[i] << "\"]";
+        }
+        outFile << "}\n";
+        return outFile.good();
+    }
+
+    // Writes candidates in the LexMapr CSV layout streamCSV() reads.
+    bool writeCandidates(const std::string& filename) {
+        std::ofstream outFile(filename);
+        if (!outFile.is_open()) {
+            std::cerr << "Failed to open " << filename << std::endl;
+            return false;
+        }
+        auto list = candidates();
+        outFile << "id,ingredient,matches\n";
+        for (size_t i = 0; i < list.size(); ++i) {
+            outFile << i << "," << list[i] << ",\"{'a':'" << list[i] << "'}\"\n";
+        }
+        return outFile.good();
+    }
+
+private:
+    SyntheticOptions options;
+    std::mt19937_64 rng;
+    std::vector<std::string> vocabulary;
+    std::vector<double> cumulative;
+    std::vector<std::string> termList;
+
+    const std::string& word() {
+        std::uniform_real_distribution<double> draw(0.0, cumulative.back());
+        size_t rank = std::lower_bound(cumulative.begin(), cumulative.end(), draw(rng)) - cumulative.begin();
+        return vocabulary[std::min(rank, vocabulary.size() - 1)];
+    }
+
+    std::string phrase(size_t numWords) {
+        std::string text = word();
+        for (size_t i = 1; i < numWords; ++i) {
+            text += " " + word();
+        }
+        return text;
+    }
+};
+
+#endif
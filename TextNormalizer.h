@@ -0,0 +1,146 @@
+#ifndef TEXT_NORMALIZER_H
+#define TEXT_NORMALIZER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Fixed set of stop words laid out at compile time in a linear-probing table of string_views,
+// so a lookup is one FNV-1a hash and a couple of comparisons, with no allocation.
+class StopWordTable {
+public:
+    static constexpr size_t CAPACITY = 256;
+
+    template<size_t N>
+    constexpr StopWordTable(const std::string_view (&words)[N]) : slots{} {
+        static_assert(N * 2 <= CAPACITY, "stop word table is too full");
+        for (size_t i = 0; i < N; ++i) {
+            size_t pos = hash(words[i]) & (CAPACITY - 1);
+            while (!slots[pos].empty() && slots[pos] != words[i]) {
+                pos = (pos + 1) & (CAPACITY - 1);
+            }
+            slots[pos] = words[i];
+        }
+    }
+
+    constexpr bool contains(std::string_view word) const {
+        if (word.empty()) {
+            return false;
+        }
+        for (size_t pos = hash(word) & (CAPACITY - 1);; pos = (pos + 1) & (CAPACITY - 1)) {
+            if (slots[pos].empty()) {
+                return false;
+            }
+            if (slots[pos] == word) {
+                return true;
+            }
+        }
+    }
+
+private:
+    std::array<std::string_view, CAPACITY> slots;
+
+    static constexpr uint32_t hash(std::string_view word) {
+        uint32_t h = 2166136261u;
+        for (char c : word) {
+            h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return h;
+    }
+};
+
+// Stop words dropped from ingredient text before it is matched against the ontology.
+constexpr std::string_view MATCH_STOP_WORD_LIST[] = {
+    "about", "all", "any", "as", "but", "can", "choice", "extra", "for", "free", "from", "good",
+    "i", "if", "in", "inch", "into", "is", "like", "more", "none", "not", "of", "on", "one",
+    "optional", "other", "pieces", "plus", "possibly", "removed", "size", "such", "the", "to",
+    "up", "use", "very", "weight", "with", "you", "your"};
+constexpr StopWordTable MATCH_STOP_WORDS(MATCH_STOP_WORD_LIST);
+
+// The longer list used when cleaning raw recipe ingredient lists, which also drops units,
+// containers and preparation words.
+constexpr std::string_view INGREDIENT_STOP_WORD_LIST[] = {
+    "about", "all", "any", "as", "bag", "bell", "bottle", "box", "but", "can", "cans",
+    "choice", "coarsely", "cubes", "cut", "dry", "extra", "fine", "finely",
+    "for", "free", "freshly", "from", "good", "grams", "i", "if", "in", "inch",
+    "into", "is", "jar", "lbs", "like", "more", "none", "not", "of", "on", "one",
+    "optional", "other", "ounce", "ounces", "pieces", "pinch", "plain", "plus",
+    "possibly", "pound", "pounds", "removed", "size", "slices", "stock", "such", "sweet",
+    "t", "tablespoon", "tablespoons", "taste", "teaspoons", "the", "thick", "thin", "thinly",
+    "to", "up", "use", "very", "weight", "with", "you", "your"};
+constexpr StopWordTable INGREDIENT_STOP_WORDS(INGREDIENT_STOP_WORD_LIST);
+
+// Single-pass text cleaner: splits on whitespace, lowercases ASCII letters, drops punctuation
+// and other bytes inside a word without splitting it, and skips stop words. Digits and
+// parenthesized asides are kept or dropped depending on the flags.
+class TextNormalizer {
+public:
+    enum Flags : unsigned {
+        KeepDigits = 1,
+        DropParenthesized = 2
+    };
+
+    explicit TextNormalizer(const StopWordTable& stopWords, unsigned flags = 0)
+        : stopWords(&stopWords), flags(flags) {}
+
+    // Writes the surviving words of `text` into `out`, separated by single spaces, and their
+    // positions into `words` as views into `out`. Both are cleared first and only grow, so a
+    // caller that reuses them across calls stops allocating once they are large enough.
+    void normalize(std::string_view text, std::string& out, std::vector<std::string_view>& words) const {
+        out.clear();
+        words.clear();
+        // Every kept word is followed by one space, so this bound keeps `out` from reallocating
+        // and the views already in `words` stay valid.
+        if (out.capacity() < text.size() + 1) {
+            out.reserve(text.size() + 1);
+        }
+
+        size_t wordStart = 0;
+        int depth = 0;
+        auto endWord = [&]() {
+            std::string_view word(out.data() + wordStart, out.size() - wordStart);
+            if (word.empty() || stopWords->contains(word)) {
+                out.resize(wordStart);
+                return;
+            }
+            words.push_back(word);
+            out.push_back(' ');
+            wordStart = out.size();
+        };
+
+        for (char c : text) {
+            if ((flags & DropParenthesized) && c == '(') {
+                ++depth;
+            }
+            else if ((flags & DropParenthesized) && c == ')' && depth > 0) {
+                --depth;
+            }
+            else if (depth > 0) {
+                continue;
+            }
+            else if (c == ' ' || (c >= '\t' && c <= '\r')) {
+                endWord();
+            }
+            else if (c >= 'A' && c <= 'Z') {
+                out.push_back(static_cast<char>(c - 'A' + 'a'));
+            }
+            else if ((c >= 'a' && c <= 'z') || ((flags & KeepDigits) && c >= '0' && c <= '9')) {
+                out.push_back(c);
+            }
+        }
+        endWord();
+
+        if (!out.empty()) {
+            out.pop_back();
+        }
+    }
+
+private:
+    const StopWordTable* stopWords;
+    unsigned flags;
+};
+
+#endif
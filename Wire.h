@@ -0,0 +1,187 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Length-prefixed message frames over a stream socket, shared by the shard workers and the
+// matching daemon. A frame is a little-endian header {uint32_t length; uint8_t type} followed
+// by `length` payload bytes, which WireWriter builds and WireReader parses. Every call returns
+// false when the peer hung up or sent something malformed.
+
+constexpr uint32_t MAX_FRAME_LENGTH = uint32_t(1) << 30;
+
+class WireWriter {
+public:
+    template<typename T>
+    void put(T value) {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+    }
+
+    void putString(std::string_view s) {
+        put(static_cast<uint32_t>(s.size()));
+        buffer.insert(buffer.end(), s.begin(), s.end());
+    }
+
+    const std::vector<char>& bytes() const { return buffer; }
+    void clear() { buffer.clear(); }
+
+private:
+    std::vector<char> buffer;
+};
+
+class WireReader {
+public:
+    WireReader(const char* data, size_t size) : pos(data), end(data + size) {}
+    explicit WireReader(const std::vector<char>& payload) : WireReader(payload.data(), payload.size()) {}
+
+    template<typename T>
+    bool get(T& value) {
+        if (size_t(end - pos) < sizeof(value)) {
+            return false;
+        }
+        std::memcpy(&value, pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    }
+
+    bool getString(std::string& s) {
+        uint32_t length;
+        if (!get(length) || size_t(end - pos) < length) {
+            return false;
+        }
+        s.assign(pos, length);
+        pos += length;
+        return true;
+    }
+
+    bool done() const { return pos == end; }
+
+private:
+    const char* pos;
+    const char* end;
+};
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool read_all(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t got = ::read(fd, data, size);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        size -= got;
+    }
+    return true;
+}
+
+bool write_frame(int fd, uint8_t type, const std::vector<char>& payload) {
+    char header[5];
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    std::memcpy(header, &length, 4);
+    header[4] = static_cast<char>(type);
+    return write_all(fd, header, sizeof(header)) && write_all(fd, payload.data(), payload.size());
+}
+
+bool read_frame(int fd, uint8_t& type, std::vector<char>& payload) {
+    char header[5];
+    if (!read_all(fd, header, sizeof(header))) {
+        return false;
+    }
+    uint32_t length;
+    std::memcpy(&length, header, 4);
+    if (length > MAX_FRAME_LENGTH) {
+        std::cerr << "Refusing a frame of " << length << " bytes" << std::endl;
+        return false;
+    }
+    type = static_cast<uint8_t>(header[4]);
+    payload.resize(length);
+    return read_all(fd, payload.data(), length);
+}
+
+// Fills a sockaddr_un for `path`; false if the path does not fit.
+bool unix_address(const std::string& path, sockaddr_un& address) {
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return false;
+    }
+    std::memcpy(address.sun_path, path.data(), path.size());
+    return true;
+}
+
+// Binds and listens on a Unix domain socket at `path`, replacing a stale socket file.
+// Returns the listening descriptor, or -1.
+int listen_unix(const std::string& path, int backlog = 64) {
+    sockaddr_un address;
+    if (!unix_address(path, address)) {
+        return -1;
+    }
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        std::cerr << "Failed to create socket: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    ::unlink(path.c_str());
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(fd, backlog) != 0) {
+        std::cerr << "Failed to listen on " << path << ": " << std::strerror(errno) << std::endl;
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Connects to the Unix domain socket at `path`, retrying every 50 ms for up to `timeoutMs`
+// while nothing listens there yet. Returns the connected descriptor, or -1.
+int connect_unix(const std::string& path, int timeoutMs = 0) {
+    sockaddr_un address;
+    if (!unix_address(path, address)) {
+        return -1;
+    }
+    for (int waited = 0;; waited += 50) {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            std::cerr << "Failed to create socket: " << std::strerror(errno) << std::endl;
+            return -1;
+        }
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            return fd;
+        }
+        int error = errno;
+        ::close(fd);
+        if ((error != ENOENT && error != ECONNREFUSED) || waited >= timeoutMs) {
+            std::cerr << "Failed to connect to " << path << ": " << std::strerror(error) << std::endl;
+            return -1;
+        }
+        ::usleep(50 * 1000);
+    }
+}
+
+#endif
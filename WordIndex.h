@@ -0,0 +1,283 @@
+#ifndef WORD_INDEX_H
+#define WORD_INDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <tbb/parallel_for.h>
+
+// Word n-grams of the candidate file -> numeric IDs of the recipes whose ingredients contain
+// them. The index is split into NUM_SHARDS shards by key hash. Blocks of input are collected
+// into a Batch by the thread that parses them and merged shard by shard, each shard merged by
+// one task at a time, so concurrent merges meet only when they reach the same shard. While
+// merging, a shard allocates its keys and recipe lists from its own arena. Recipe lists grow
+// by chaining blocks rather than reallocating, since an arena never reuses an outgrown buffer.
+//
+// finish() then turns every list into a sorted posting list of varint-coded deltas, packed
+// back to back in one byte array per shard with the keys in a fresh arena, and frees the
+// build arenas in one piece. find() may run once finish() has returned; clear() frees the rest.
+class WordIndex {
+public:
+    static constexpr size_t NUM_SHARDS = 64;
+
+    // Recipe IDs in the order added, in blocks taken from an arena, each block twice the size
+    // of the one before.
+    class RecipeList {
+    public:
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        uint64_t back() const { return tail->values()[tail->size - 1]; }
+
+        void push_back(uint64_t recipe, std::pmr::memory_resource& arena) {
+            if (!tail || tail->size == tail->capacity) {
+                uint32_t capacity = tail ? tail->capacity * 2 : 2;
+                void* memory = arena.allocate(sizeof(Block) + capacity * sizeof(uint64_t), alignof(Block));
+                Block* block = new (memory) Block{nullptr, capacity, 0};
+                (tail ? tail->next : head) = block;
+                tail = block;
+            }
+            tail->values()[tail->size++] = recipe;
+            ++count;
+        }
+
+        template<typename Func>
+        void forEach(Func&& func) const {
+            for (const Block* block = head; block; block = block->next) {
+                for (uint32_t i = 0; i < block->size; ++i) {
+                    func(block->values()[i]);
+                }
+            }
+        }
+
+    private:
+        // Followed in memory by `capacity` recipe IDs.
+        struct Block {
+            Block* next;
+            uint32_t capacity;
+            uint32_t size;
+
+            uint64_t* values() { return reinterpret_cast<uint64_t*>(this + 1); }
+            const uint64_t* values() const { return reinterpret_cast<const uint64_t*>(this + 1); }
+        };
+
+        Block* head = nullptr;
+        Block* tail = nullptr;
+        size_t count = 0;
+    };
+
+    using Map = std::pmr::unordered_map<std::string_view, RecipeList>;
+
+    static size_t shardOf(std::string_view key) {
+        // The top bits of a multiplicative hash, so the shard does not pick the map buckets.
+        return (std::hash<std::string_view>()(key) * 0x9E3779B97F4A7C15ULL) >> 58;
+    }
+
+    // `count` distinct recipe IDs in ascending order, decoded on the fly.
+    class Postings {
+    public:
+        size_t size() const { return count; }
+
+        template<typename Func>
+        void forEach(Func&& func) const {
+            const uint8_t* p = data;
+            uint64_t recipe = 0;
+            for (uint32_t i = 0; i < count; ++i) {
+                uint64_t delta = 0;
+                for (int shift = 0;; shift += 7) {
+                    uint8_t byte = *p++;
+                    delta |= uint64_t(byte & 0x7F) << shift;
+                    if (byte < 0x80) {
+                        break;
+                    }
+                }
+                recipe += delta;
+                func(recipe);
+            }
+        }
+
+    private:
+        friend class WordIndex;
+        const uint8_t* data = nullptr;
+        uint32_t count = 0;
+    };
+
+    // One block's n-grams, partitioned by shard. Keys are copied into the batch's arena, which
+    // is released in one piece with the batch. The shard maps are sized for `expectedKeys`
+    // distinct keys up front, so they seldom rehash and leave outgrown bucket arrays in the arena.
+    class Batch {
+    public:
+        explicit Batch(size_t expectedKeys = 0) : arena(size_t(1) << 16) {
+            parts.reserve(NUM_SHARDS);
+            for (size_t s = 0; s < NUM_SHARDS; ++s) {
+                parts.emplace_back(&arena);
+                parts.back().reserve(expectedKeys / NUM_SHARDS);
+            }
+        }
+
+        void add(std::string_view key, uint64_t recipe) {
+            Map& part = parts[shardOf(key)];
+            auto it = part.find(key);
+            if (it == part.end()) {
+                it = part.emplace(copy(arena, key), RecipeList()).first;
+            }
+            // A recipe's ingredients are adjacent in the input, so repeats are adjacent too.
+            if (it->second.empty() || it->second.back() != recipe) {
+                it->second.push_back(recipe, arena);
+            }
+        }
+
+    private:
+        friend class WordIndex;
+        std::pmr::monotonic_buffer_resource arena;
+        std::vector<Map> parts;
+    };
+
+    WordIndex() : shards(new Shard[NUM_SHARDS]) {}
+
+    // Adds `batch` to the index and appends the keys it did not hold before to `added`.
+    void merge(const Batch& batch, std::vector<std::string>& added) {
+        std::vector<std::vector<std::string_view>> newKeys(NUM_SHARDS);
+        tbb::parallel_for(size_t(0), NUM_SHARDS, [&](size_t s) {
+            if (batch.parts[s].empty()) {
+                return;
+            }
+            Shard& shard = shards[s];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            Map& entries = shard.building->entries;
+            for (const auto& [key, recipes] : batch.parts[s]) {
+                auto it = entries.find(key);
+                if (it == entries.end()) {
+                    it = entries.emplace(copy(shard.building->arena, key), RecipeList()).first;
+                    newKeys[s].push_back(it->first);
+                }
+                RecipeList& list = it->second;
+                recipes.forEach([&](uint64_t recipe) {
+                    if (list.empty() || list.back() != recipe) {
+                        list.push_back(recipe, shard.building->arena);
+                    }
+                });
+            }
+        });
+        for (const auto& keys : newKeys) {
+            added.insert(added.end(), keys.begin(), keys.end());
+        }
+    }
+
+    // Compresses the merged lists; call once after the last merge().
+    void finish() {
+        tbb::parallel_for(size_t(0), NUM_SHARDS, [&](size_t s) {
+            Shard& shard = shards[s];
+            if (!shard.building) {
+                return;
+            }
+            shard.lists.reserve(shard.building->entries.size());
+            std::vector<uint64_t> recipes;
+            for (const auto& [key, list] : shard.building->entries) {
+                recipes.clear();
+                list.forEach([&](uint64_t recipe) { recipes.push_back(recipe); });
+                std::sort(recipes.begin(), recipes.end());
+                recipes.erase(std::unique(recipes.begin(), recipes.end()), recipes.end());
+                shard.lists.emplace(copy(shard.keyArena, key),
+                                    ListRef{shard.bytes.size(), static_cast<uint32_t>(recipes.size())});
+                uint64_t previous = 0;
+                for (uint64_t recipe : recipes) {
+                    putVarint(shard.bytes, recipe - previous);
+                    previous = recipe;
+                }
+                shard.maxRecipe = std::max(shard.maxRecipe, previous);
+            }
+            shard.bytes.shrink_to_fit();
+            shard.building.reset();
+        });
+    }
+
+    // Recipes containing `key`; false if no recipe does.
+    bool find(std::string_view key, Postings& postings) const {
+        const Shard& shard = shards[shardOf(key)];
+        auto it = shard.lists.find(key);
+        if (it == shard.lists.end()) {
+            return false;
+        }
+        postings.data = shard.bytes.data() + it->second.offset;
+        postings.count = it->second.count;
+        return true;
+    }
+
+    // Largest recipe ID in the index, 0 if it is empty.
+    uint64_t maxRecipe() const {
+        uint64_t result = 0;
+        for (size_t s = 0; s < NUM_SHARDS; ++s) {
+            result = std::max(result, shards[s].maxRecipe);
+        }
+        return result;
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (size_t s = 0; s < NUM_SHARDS; ++s) {
+            total += shards[s].lists.size() + (shards[s].building ? shards[s].building->entries.size() : 0);
+        }
+        return total;
+    }
+
+    // Bytes of compressed posting lists.
+    size_t postingBytes() const {
+        size_t total = 0;
+        for (size_t s = 0; s < NUM_SHARDS; ++s) {
+            total += shards[s].bytes.size();
+        }
+        return total;
+    }
+
+    // Drops every entry and returns the arenas' memory.
+    void clear() {
+        shards.reset(new Shard[NUM_SHARDS]);
+    }
+
+private:
+    struct ListRef {
+        uint64_t offset;
+        uint32_t count;
+    };
+
+    struct Building {
+        std::pmr::monotonic_buffer_resource arena{size_t(1) << 16};
+        // Declared after the arena, so it is destroyed first.
+        Map entries{&arena};
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unique_ptr<Building> building = std::make_unique<Building>();
+        std::pmr::monotonic_buffer_resource keyArena;
+        std::pmr::unordered_map<std::string_view, ListRef> lists{&keyArena};
+        std::vector<uint8_t> bytes;
+        uint64_t maxRecipe = 0;
+    };
+
+    std::unique_ptr<Shard[]> shards;
+
+    static std::string_view copy(std::pmr::memory_resource& arena, std::string_view s) {
+        char* data = static_cast<char*>(arena.allocate(s.size() == 0 ? 1 : s.size(), 1));
+        std::memcpy(data, s.data(), s.size());
+        return std::string_view(data, s.size());
+    }
+
+    static void putVarint(std::vector<uint8_t>& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<uint8_t>(value) | 0x80);
+            value >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(value));
+    }
+};
+
+#endif
@@ -1,194 +1,708 @@
-#include "LSH_Wrapper.h"
 #include "LSH.h"
+#include "LSHForest.h"
+#include "ShardedIndex.h"
+#include "MatchDaemon.h"
 #include "ReadFile.h"
 #include "NGram.h"
 #include "Memory_Usage.h"
 #include "util.h"
+#include "TextNormalizer.h"
+#include "QueryCache.h"
+#include "Metrics.h"
+#include "BandingTuner.h"
+#include "ResultWriter.h"
+#include "Ontology.h"
+#include "WordIndex.h"
+#include "CandidateWords.h"
 #include <chrono>
+#include <thread>
 #include <unordered_set>
-#include <future>
+#include <tbb/global_control.h>
 #include <cmath>
 #include <tbb/concurrent_unordered_map.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/parallel_pipeline.h>
 
-std::unordered_set<std::string> word_set = {"about", "all", "any", "as", "but", "can",
-                                            "choice", "extra", "for", "free", "from", "good", "i", "if", "in", "inch",
-                                            "into", "is", "like", "more", "none", "not", "of", "on", "one",
-                                            "optional", "other", "pieces", "plus", "possibly", "removed", "size", "such",
-                                            "the", "to", "up", "use", "very", "weight", "with", "you", "your"};
-std::queue<std::pair<std::string, std::vector<std::string>>> tasks;
-tbb::concurrent_unordered_map<std::string, std::string> inverted_index;
-tbb::concurrent_unordered_map<std::string, std::unordered_set<std::string>> cache;
-tbb::concurrent_unordered_map<std::string, std::unordered_set<std::string>> cache_single;
-tbb::concurrent_unordered_map<std::string, std::unordered_set<std::string>> mismatch;
 tbb::concurrent_unordered_map<std::string, std::unordered_set<std::string>> ingredients_matches;
-tbb::concurrent_unordered_map<std::string, std::unordered_set<std::string>> inverted_index_multiple;
-tbb::concurrent_unordered_map<std::string, std::unordered_set<std::string>> inverted_index_single;
-std::unordered_map<std::string, std::unordered_set<std::string>> matches;
-std::mutex mutex;
-
-std::vector<std::string> filter_string(const std::string& input_string) {
-    std::istringstream iss(input_string);
-    std::vector<std::string> words;
-    std::string word;
-
-    std::string filtered_word;
-
-    while (iss >> word) {
-        filtered_word.clear();
-        for (char ch : word) {
-            if (std::isalpha(ch) || std::isspace(ch)) {
-                filtered_word += std::tolower(ch);
-            }
-        }
-        if (filtered_word.empty()) {
-            continue;
-        }
-        if (word_set.find(filtered_word) == word_set.end()) {
-            words.push_back(std::move(filtered_word));
-            filtered_word = std::string();
+WordIndex inverted_index_multiple;
+WordIndex inverted_index_single;
+tbb::concurrent_unordered_map<std::string, std::vector<std::pair<std::string, double>>> ingredients_ranked;
+std::mutex results_mutex;
+
+struct MatchOptions {
+    int hashFuncs = 100;
+    int bands = 25;
+    // When non-zero, only the k most similar ontology terms are kept per query and per recipe.
+    size_t topK = 0;
+    // Upper bound on worker threads for every parallel stage; 0 uses all cores.
+    int threads = 0;
+    // Give the 0.9 single-word queries their own banding, tuned for that threshold, instead of
+    // sending them through the 0.5 banding.
+    bool tuneBandings = true;
+    // Perturbed band keys probed per query on top of the exact ones (multi-probe LSH).
+    int probes = 0;
+    // Answer queries from an LSH Forest of this many trees, which picks its prefix length per
+    // query threshold, instead of the banded index; 0 uses the banded index.
+    int forestTrees = 0;
+    // When non-zero, check every banding on this many ontology terms before matching.
+    size_t validationSample = 0;
+    // Split the index over this many worker processes, queried over Unix domain sockets;
+    // 0 keeps it in this process.
+    int shards = 0;
+    // --serve: coalesce requests for up to this long, or until a batch holds this many queries.
+    int batchWindowUs = 2000;
+    size_t maxBatchQueries = 8192;
+    OutputFormat outputFormat = OutputFormat::Text;
+    // Keep query results in [ontology].cache between runs.
+    bool cacheFile = false;
+    // Hash the whole saved index on load instead of only bounds-checking its tables.
+    bool verifyIndex = false;
+    // Where to write the per-stage metrics report and the Chrome trace; empty to skip.
+    std::string metricsPath;
+    std::string tracePath;
+};
+
+// The indexes answer the same queries; only the banded one (local or sharded) takes a probe
+// count.
+std::vector<std::pair<std::string, double>> ranked_query(LSH& lsh, const std::string& text, size_t k,
+                                                         double threshold, int probes) {
+    return lsh.query_topk(text, k, threshold, probes);
+}
+
+std::vector<std::pair<std::string, double>> ranked_query(LSHForest& forest, const std::string& text, size_t k,
+                                                         double threshold, int) {
+    return forest.query_topk(text, k, threshold);
+}
+
+// The batch queries return false only when a shard stops answering, which leaves no way to
+// finish the match.
+template<typename Index>
+bool ranked_batch(Index& lsh, const std::vector<std::string>& queries, const std::vector<double>& thresholds,
+                  size_t k, int probes, std::vector<std::vector<std::pair<std::string, double>>>& ranked) {
+    ranked.assign(queries.size(), {});
+    tbb::parallel_for(size_t(0), queries.size(), [&](size_t i) {
+        ranked[i] = ranked_query(lsh, queries[i], k, thresholds[i], probes);
+    });
+    return true;
+}
+
+bool ranked_batch(ShardCoordinator& shards, const std::vector<std::string>& queries,
+                  const std::vector<double>& thresholds, size_t k, int probes,
+                  std::vector<std::vector<std::pair<std::string, double>>>& ranked) {
+    std::vector<std::vector<std::pair<uint32_t, double>>> ids;
+    if (!shards.query_topk_batch(queries, thresholds, k, probes, ids)) {
+        return false;
+    }
+    ranked.assign(queries.size(), {});
+    for (size_t i = 0; i < ids.size(); ++i) {
+        for (const auto& [id, similarity] : ids[i]) {
+            ranked[i].emplace_back(std::string(shards.docLabel(id)), similarity);
         }
     }
-    return words;
+    return true;
 }
 
-void process_chunk_words(
-    const std::unordered_map<std::string, std::string>::iterator& start,
-    const std::unordered_map<std::string, std::string>::iterator& end, int thread_id) {
+bool ranked_batch(MatchClient& client, const std::vector<std::string>& queries,
+                  const std::vector<double>& thresholds, size_t k, int,
+                  std::vector<std::vector<std::pair<std::string, double>>>& ranked) {
+    std::vector<std::vector<std::pair<uint32_t, double>>> terms;
+    if (!client.query_topk_batch(queries, thresholds, k, terms)) {
+        return false;
+    }
+    ranked.assign(queries.size(), {});
+    for (size_t i = 0; i < terms.size(); ++i) {
+        for (const auto& [term, similarity] : terms[i]) {
+            ranked[i].emplace_back(std::string(client.docLabel(term)), similarity);
+        }
+    }
+    return true;
+}
 
-    std::unordered_map<std::string, std::unordered_set<std::string>> local_index_multiple;
-    std::unordered_map<std::string, std::unordered_set<std::string>> local_index_single;
+// The daemon probes its index with its own --probes.
+bool batch_query(MatchClient& client, const std::vector<std::string>& queries, const std::vector<double>& thresholds,
+                 int, std::vector<std::vector<uint32_t>>& results) {
+    return client.query_batch(queries, thresholds, results);
+}
 
-    int completed_tasks = 0;
+bool batch_query(ShardCoordinator& shards, const std::vector<std::string>& queries,
+                 const std::vector<double>& thresholds, int probes, std::vector<std::vector<uint32_t>>& results) {
+    return shards.query_batch(queries, thresholds, probes, results);
+}
 
-    for (auto it = start; it != end; ++it) {
-        auto filtered_string = filter_string(it->second);
-        auto words = text_to_ngrams_words(filtered_string, 2);
+bool batch_query(LSH& lsh, const std::vector<std::string>& queries, const std::vector<double>& thresholds, int probes,
+                 std::vector<std::vector<uint32_t>>& results) {
+    results = lsh.query_batch(queries, thresholds, probes);
+    return true;
+}
 
-        for (const auto& w : words) {
-            local_index_multiple[w].insert(it->first);
-        }
+bool batch_query(LSHForest& forest, const std::vector<std::string>& queries, const std::vector<double>& thresholds,
+                 int, std::vector<std::vector<uint32_t>>& results) {
+    results = forest.query_batch(queries, thresholds);
+    return true;
+}
 
-        auto single_words = text_to_ngrams_words(filtered_string, 1);
-        for (const auto& w : single_words) {
-            local_index_single[w].insert(it->first);
+template<typename Index>
+bool process_chunk_topk(const std::vector<std::pair<std::string, std::string>>& tasks, Index& lsh, size_t k,
+                        int probes, QueryCache& cache) {
+    // As in process_chunk(), only the queries the cache cannot answer go to the index.
+    std::vector<std::vector<std::pair<std::string, double>>> ranked(tasks.size());
+    std::vector<std::string> cacheKeys(tasks.size());
+    std::vector<size_t> missed;
+    std::vector<std::string> queries;
+    std::vector<double> thresholds;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        const auto& [key, indicator] = tasks[i];
+        double threshold = indicator == "single" ? 0.9 : 0.5;
+        cacheKeys[i] = QueryCache::key(key, threshold, k);
+        QueryCache::Entry entry;
+        if (cache.find(cacheKeys[i], entry)) {
+            for (size_t j = 0; j < entry.labels.size(); ++j) {
+                ranked[i].emplace_back(std::move(entry.labels[j]), entry.scores[j]);
+            }
         }
-        completed_tasks++;
-        if (completed_tasks % 10000 == 0) {
-            std::cout << completed_tasks << "th task completed on thread " << thread_id << std::endl;
+        else {
+            missed.push_back(i);
+            queries.push_back(key);
+            thresholds.push_back(threshold);
         }
     }
 
-    std::lock_guard<std::mutex> lock(mutex);
-    for (const auto& [key, value] : local_index_multiple) {
-        inverted_index_multiple[key].insert(value.begin(), value.end());
+    std::vector<std::vector<std::pair<std::string, double>>> answers;
+    if (!ranked_batch(lsh, queries, thresholds, k, probes, answers)) {
+        return false;
     }
-    local_index_multiple.clear();
-    for (const auto& [key, value] : local_index_single) {
-        inverted_index_single[key].insert(value.begin(), value.end());
+    for (size_t m = 0; m < missed.size(); ++m) {
+        QueryCache::Entry entry;
+        for (const auto& [label, similarity] : answers[m]) {
+            entry.labels.push_back(label);
+            entry.scores.push_back(similarity);
+        }
+        cache.insert(cacheKeys[missed[m]], std::move(entry));
+        ranked[missed[m]] = std::move(answers[m]);
+    }
+
+    std::lock_guard<std::mutex> lock(results_mutex);
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        auto& lst = ingredients_ranked[tasks[i].first];
+        lst.insert(lst.end(), ranked[i].begin(), ranked[i].end());
     }
-    local_index_single.clear();
+    return true;
 }
 
-void process_chunk(int thread_id, const std::vector<std::pair<std::string, std::string>>& tasks,
-                   LSH& lsh, int n){
-    int completedTasks = 0;
-    std::unordered_map<std::string, std::unordered_set<std::string>> local_mismatch;
-    std::unordered_map<std::string, std::unordered_set<std::string>> local_ingredients_matches;
-    for (int i = 0; i < tasks.size(); ++i) {
-        const auto& task = tasks[i];
-        auto key = std::get<0>(task);
-        std::unordered_set<std::string> set;
-        auto indicator = std::get<1>(task);
-        if (indicator == "single") {
-            auto candidates = lsh.query(text_to_ngrams(key, n), 0.9);
-            set.insert(candidates.begin(), candidates.end());
+template<typename Index>
+bool process_chunk(const std::vector<std::pair<std::string, std::string>>& tasks, Index& lsh, int probes,
+                   QueryCache& cache) {
+    // Answer what the cache knows and send only the misses to the index, as one batch.
+    std::vector<QueryCache::Entry> results(tasks.size());
+    std::vector<std::string> cacheKeys(tasks.size());
+    std::vector<size_t> missed;
+    std::vector<std::string> queries;
+    std::vector<double> thresholds;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        const auto& [key, indicator] = tasks[i];
+        double threshold = indicator == "single" ? 0.9 : 0.5;
+        cacheKeys[i] = QueryCache::key(key, threshold);
+        if (!cache.find(cacheKeys[i], results[i])) {
+            missed.push_back(i);
+            queries.push_back(key);
+            thresholds.push_back(threshold);
         }
-        else {
-            auto candidates = lsh.query(text_to_ngrams(key, n), 0.5);
-            set.insert(candidates.begin(), candidates.end());
+    }
+
+    std::vector<std::vector<uint32_t>> candidates;
+    if (!batch_query(lsh, queries, thresholds, probes, candidates)) {
+        return false;
+    }
+    for (size_t m = 0; m < missed.size(); ++m) {
+        auto& labels = results[missed[m]].labels;
+        for (uint32_t docID : candidates[m]) {
+            labels.emplace_back(lsh.docLabel(docID));
         }
+        cache.insert(cacheKeys[missed[m]], results[missed[m]]);
+    }
+
+    std::lock_guard<std::mutex> lock(results_mutex);
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        auto& set = ingredients_matches[tasks[i].first];
+        set.insert(results[i].labels.begin(), results[i].labels.end());
+    }
+    return true;
+}
 
-        local_ingredients_matches[key].insert(set.begin(), set.end());
+// Adds the word bigrams and words of `records` to the inverted indexes and returns those not
+// seen before, each tagged "multiple" or "single", as the queries to run.
+std::vector<std::pair<std::string, std::string>> index_chunk_words(const std::vector<CandidateRecord>& records) {
+    std::vector<std::string> addedMultiple, addedSingle;
+    index_candidate_words(records, inverted_index_multiple, inverted_index_single, addedMultiple, addedSingle);
 
-        completedTasks++;
+    std::vector<std::pair<std::string, std::string>> tasks;
+    tasks.reserve(addedMultiple.size() + addedSingle.size());
+    for (auto& key : addedMultiple) {
+        tasks.push_back({std::move(key), "multiple"});
+    }
+    for (auto& key : addedSingle) {
+        tasks.push_back({std::move(key), "single"});
+    }
+    return tasks;
+}
+
+// Indexes one block of streamed candidates by word n-gram and immediately queries the n-grams
+// that no earlier block has produced, so matching overlaps with reading the input. Returns false
+// if the index could not answer.
+template<typename Index>
+bool process_chunk_words(const std::vector<CandidateRecord>& records, Index& lsh, QueryCache& cache,
+                         const MatchOptions& options) {
+    std::vector<std::pair<std::string, std::string>> tasks;
+    {
+        ScopedStage stage("word_index");
+        tasks = index_chunk_words(records);
     }
+    Metrics::instance().addCounter("candidate_records", records.size());
+    Metrics::instance().addCounter("distinct_query_terms", tasks.size());
 
-    for (auto& pair : local_ingredients_matches) {
-        ingredients_matches[pair.first].insert(pair.second.begin(), pair.second.end());
+    if (tasks.empty()) {
+        return true;
+    }
+    ScopedStage stage("query");
+    if (options.topK > 0) {
+        return process_chunk_topk(tasks, lsh, options.topK, options.probes, cache);
     }
+    return process_chunk(tasks, lsh, options.probes, cache);
 }
 
-void match(std::string ontologyPath, std::string ingredientPath, std::string outputPath, int hash_funcs = 100, int band = 25) {
-    LSH lsh(band, hash_funcs);
-    std::string filename = outputPath;
-    std::unordered_map<std::string, std::pair<std::string, std::string>> index;
-    int n = 3;
-    tbb::concurrent_unordered_map<std::string, std::unordered_set<std::string>> cache;
+// Prints the predicted and measured error rates of every banding of `lsh`, measured on an
+// evenly spaced sample of the ontology terms.
+void validate_bandings(const LSH& lsh, const std::vector<std::string>& ontologies, const MatchOptions& options) {
+    std::vector<std::string> sample;
+    size_t step = std::max<size_t>(1, ontologies.size() / options.validationSample);
+    for (size_t i = 0; i < ontologies.size() && sample.size() < options.validationSample; i += step) {
+        sample.push_back(ontologies[i]);
+    }
+    MinHasher hasher(options.hashFuncs);
+    for (const auto& banding : lsh.getBandings()) {
+        BandingValidation measured = validate_banding(sample, hasher, 3, banding.bands, banding.rows, banding.threshold);
+        std::cout << "Banding " << banding.bands << "x" << banding.rows << " for threshold " << banding.threshold
+                  << ": predicted false positives " << mean_collision_probability(0.0, banding.threshold, banding.bands, banding.rows, false)
+                  << ", false negatives " << mean_collision_probability(banding.threshold, 1.0, banding.bands, banding.rows, true)
+                  << "; measured " << measured.falsePositiveRate() << " of " << measured.pairsBelow << " pairs, "
+                  << measured.falseNegativeRate() << " of " << measured.pairsAbove << " pairs" << std::endl;
+    }
+}
 
-    json json = process_json(ontologyPath);
-    std::unordered_map<std::string, std::vector<std::string>> lexMaprIngredients = processCSV(ingredientPath, 1);
-    std::unordered_map<std::string, std::unordered_set<std::string>> possible_matches;
-    std::unordered_map<std::string, std::string> ingredients;
-    for (auto& [key, value] : lexMaprIngredients) {
-        ingredients[key] = value[0];
-        possible_matches[key].insert(value.begin() + 1, value.end());
+// Streams the candidates through `lsh`, answering repeated queries from the query cache under
+// `fingerprint`, kept in `cache_filename` unless that is empty. Returns false if the candidates
+// could not be read or the index stopped answering; the blocks after a failure are skipped.
+template<typename Index>
+bool match_candidates(const std::string& cache_filename, const std::string& ingredientPath, Index& lsh,
+                      uint64_t fingerprint, const MatchOptions& options) {
+    // Probing changes the results, so results cached under another probe count are not reused.
+    QueryCache queryCache(mix64(fingerprint ^ static_cast<uint64_t>(options.probes)));
+    if (!cache_filename.empty()) {
+        queryCache.load(cache_filename);
     }
-    lexMaprIngredients.clear();
-    std::vector<std::string> ontologies = parseJson(json, index, inverted_index);
 
-    const size_t max_concurrent_tasks = std::min(std::thread::hardware_concurrency(), static_cast<unsigned int>(ingredients.size()));
-    std::vector<std::thread> threads;
+    std::atomic<bool> failed{false};
+    bool streamed;
+    {
+        ScopedStage stage("match");
+        streamed = streamCSV(ingredientPath, [&](const std::vector<CandidateRecord>& records) {
+            if (!failed.load(std::memory_order_relaxed) && !process_chunk_words(records, lsh, queryCache, options)) {
+                failed.store(true, std::memory_order_relaxed);
+            }
+        }, candidate_stream_options());
+    }
+    if (!streamed || failed.load()) {
+        return false;
+    }
+    {
+        ScopedStage stage("word_index_compress");
+        inverted_index_multiple.finish();
+        inverted_index_single.finish();
+    }
 
-    auto it = ingredients.begin();
-    size_t length = ingredients.size() / max_concurrent_tasks;
+    Metrics& metrics = Metrics::instance();
+    metrics.addCounter("query_cache_hits", queryCache.hits());
+    metrics.addCounter("query_cache_misses", queryCache.misses());
+    metrics.addCounter("word_index_posting_bytes",
+                       inverted_index_multiple.postingBytes() + inverted_index_single.postingBytes());
+    if (!cache_filename.empty()) {
+        std::cout << "Query cache: " << queryCache.hits() << " hits, " << queryCache.misses() << " misses" << std::endl;
+        queryCache.save(cache_filename);
+    }
+    return true;
+}
 
-    for (size_t i = 0; i < max_concurrent_tasks; ++i) {
-        auto end = std::next(it, i == max_concurrent_tasks - 1 ? ingredients.size() - length * i : length);
-        threads.emplace_back(process_chunk_words, it, end, i);
-        it = end;
+// The term table of the output: one term per distinct label, in order of first appearance; a
+// label shared by several IDs takes the ID and definition of the last.
+std::vector<OntologyTerm> ontology_terms(const Ontology& ontology) {
+    std::vector<OntologyTerm> terms;
+    std::unordered_map<std::string_view, uint32_t> termIndex;
+    for (size_t i = 0; i < ontology.size(); ++i) {
+        auto [it, inserted] = termIndex.emplace(ontology.label(i), terms.size());
+        if (inserted) {
+            terms.push_back(OntologyTerm{std::string(ontology.id(i)), std::string(ontology.label(i)),
+                                         std::string(ontology.definition(i))});
+        }
+        else {
+            terms[it->second].id = ontology.id(i);
+            terms[it->second].definition = ontology.definition(i);
+        }
     }
+    return terms;
+}
 
-    for (auto& t : threads) {
-        t.join();
+// Attributes every n-gram's matches to the recipes containing it and writes one record per
+// recipe. A recipe's record is complete only once every query has run, since any of its
+// n-grams may have been queried for an earlier block, so this runs after matching; but the
+// n-grams are resolved, the recipes grouped (in buckets by recipe hash) and the records
+// formatted in parallel, and formatted buckets stream to the file as they are ready.
+bool write_results(const std::string& filename, const std::vector<OntologyTerm>& terms, const MatchOptions& options) {
+    std::unordered_map<std::string_view, uint32_t> termIndex;
+    for (uint32_t i = 0; i < terms.size(); ++i) {
+        termIndex.emplace(terms[i].label, i);
     }
 
-    std::string bin_filename = get_base_filename(ontologyPath) + ".bin";
-    if (file_exists(bin_filename)) {
-        lsh.load_from_disk(bin_filename);
+    // An n-gram that is a whole ingredient somewhere counts for the recipes of that form only.
+    auto recipesOf = [](const std::string& key, WordIndex::Postings& recipes) {
+        return inverted_index_multiple.find(key, recipes) || inverted_index_single.find(key, recipes);
+    };
+    struct KeyMatches {
+        WordIndex::Postings recipes;
+        const std::unordered_set<std::string>* labels = nullptr;
+        const std::vector<std::pair<std::string, double>>* ranked = nullptr;
+        std::vector<uint32_t> terms;
+        std::vector<double> scores;
+    };
+    const bool ranked = options.topK > 0;
+    std::vector<KeyMatches> keys;
+    if (ranked) {
+        for (const auto& [key, value] : ingredients_ranked) {
+            WordIndex::Postings recipes;
+            if (recipesOf(key, recipes)) {
+                KeyMatches& match = keys.emplace_back();
+                match.recipes = recipes;
+                match.ranked = &value;
+            }
+        }
     }
     else {
-        for (int i = 0; i < ontologies.size(); ++i) {
-            lsh.insert(text_to_ngrams(ontologies[i], n), ontologies[i]);
+        for (const auto& [key, value] : ingredients_matches) {
+            WordIndex::Postings recipes;
+            if (recipesOf(key, recipes)) {
+                KeyMatches& match = keys.emplace_back();
+                match.recipes = recipes;
+                match.labels = &value;
+            }
+        }
+    }
+
+    // Buckets hold consecutive ranges of recipe IDs, so the records come out in ID order.
+    constexpr size_t NUM_BUCKETS = 256;
+    const uint64_t bucketWidth = std::max(inverted_index_multiple.maxRecipe(), inverted_index_single.maxRecipe()) / NUM_BUCKETS + 1;
+    using Partition = std::vector<std::vector<std::pair<uint64_t, uint32_t>>>;
+    tbb::enumerable_thread_specific<Partition> partitions([] { return Partition(NUM_BUCKETS); });
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, keys.size(), 256), [&](const tbb::blocked_range<size_t>& r) {
+        Partition& local = partitions.local();
+        for (size_t k = r.begin(); k != r.end(); ++k) {
+            KeyMatches& key = keys[k];
+            auto addTerm = [&](const std::string& label, double score) {
+                auto it = termIndex.find(label);
+                if (it != termIndex.end()) {
+                    key.terms.push_back(it->second);
+                    key.scores.push_back(score);
+                }
+            };
+            if (key.labels) {
+                for (const auto& label : *key.labels) {
+                    addTerm(label, 0.0);
+                }
+            }
+            else {
+                for (const auto& [label, similarity] : *key.ranked) {
+                    addTerm(label, similarity);
+                }
+            }
+            key.recipes.forEach([&](uint64_t recipe) {
+                local[recipe / bucketWidth].emplace_back(recipe, k);
+            });
+        }
+    });
+
+    // Ranked records keep each term's best score over the recipe's n-grams, then the k best.
+    std::vector<std::vector<RecipeMatches>> buckets(NUM_BUCKETS);
+    tbb::parallel_for(size_t(0), NUM_BUCKETS, [&](size_t b) {
+        std::vector<std::pair<uint64_t, uint32_t>> pairs;
+        for (const Partition& partition : partitions) {
+            pairs.insert(pairs.end(), partition[b].begin(), partition[b].end());
+        }
+        std::sort(pairs.begin(), pairs.end());
+        std::vector<std::pair<uint32_t, double>> scored;
+        for (size_t i = 0; i < pairs.size();) {
+            RecipeMatches recipe{pairs[i].first, 0, {}, {}};
+            scored.clear();
+            for (; i < pairs.size() && pairs[i].first == recipe.recipe; ++i) {
+                const KeyMatches& key = keys[pairs[i].second];
+                for (size_t j = 0; j < key.terms.size(); ++j) {
+                    scored.emplace_back(key.terms[j], key.scores[j]);
+                }
+            }
+            std::sort(scored.begin(), scored.end(), [](const auto& a, const auto& b) {
+                return a.first != b.first ? a.first < b.first : a.second > b.second;
+            });
+            scored.erase(std::unique(scored.begin(), scored.end(),
+                                     [](const auto& a, const auto& b) { return a.first == b.first; }),
+                         scored.end());
+            if (ranked) {
+                std::sort(scored.begin(), scored.end(), [&](const auto& a, const auto& b) {
+                    return a.second != b.second ? a.second > b.second : terms[a.first].label < terms[b.first].label;
+                });
+                scored.resize(std::min(scored.size(), options.topK));
+            }
+            for (const auto& [term, score] : scored) {
+                recipe.terms.push_back(term);
+                if (ranked) {
+                    recipe.scores.push_back(score);
+                }
+            }
+            buckets[b].push_back(std::move(recipe));
         }
+    });
+
+    std::vector<uint64_t> recipes;
+    for (auto& bucket : buckets) {
+        for (RecipeMatches& recipe : bucket) {
+            recipe.recipeIndex = static_cast<uint32_t>(recipes.size());
+            recipes.push_back(recipe.recipe);
+        }
+    }
+
+    ResultWriter writer(filename, options.outputFormat, terms, ranked);
+    if (!writer.open()) {
+        return false;
+    }
+    size_t nextBucket = 0;
+    bool ok = true;
+    tbb::parallel_pipeline(16,
+        tbb::make_filter<void, size_t>(tbb::filter_mode::serial_in_order, [&](tbb::flow_control& fc) -> size_t {
+            if (nextBucket == NUM_BUCKETS) {
+                fc.stop();
+                return 0;
+            }
+            return nextBucket++;
+        }) &
+        tbb::make_filter<size_t, std::string>(tbb::filter_mode::parallel, [&](size_t b) {
+            std::string chunk;
+            writer.formatBlock(buckets[b], chunk);
+            return chunk;
+        }) &
+        tbb::make_filter<std::string, void>(tbb::filter_mode::serial_in_order, [&](const std::string& chunk) {
+            ok = ok && writer.write(chunk);
+        }));
+    Metrics::instance().addCounter("output_records", recipes.size());
+    return writer.finish(recipes) && ok;
+}
+
+// Gives the 0.9 single-word queries their own tuned banding unless --no-tune was given.
+void add_query_bandings(LSH& lsh, const MatchOptions& options) {
+    if (options.tuneBandings) {
+        BandingChoice single = tune_banding(options.hashFuncs, 0.9);
+        lsh.add_banding(single.bands, single.rows, 0.9);
+    }
+}
+
+// Loads the saved index `bin_filename` if it was built with the same parameters; otherwise
+// builds the index from `ontologies` and saves it. If the ontology changed since the index was
+// saved, the difference is applied as a delta and compacted in the background; the function
+// then returns true, and the caller saves the index once compaction ends.
+bool prepare_index(LSH& lsh, const std::string& bin_filename, const std::vector<std::string>& ontologies,
+                   const MatchOptions& options) {
+    bool loaded = false;
+    if (file_exists(bin_filename)) {
+        ScopedStage stage("lsh_load");
+        loaded = lsh.load_from_disk(bin_filename, options.verifyIndex, true);
+    }
+    if (!loaded) {
+        {
+            ScopedStage stage("lsh_build");
+            // One document per label, as the shards index them, rather than tombstoned repeats.
+            lsh.bulk_build(distinct_terms(ontologies));
+        }
+        ScopedStage stage("lsh_save");
         lsh.save_to_disk(bin_filename);
+        return false;
     }
-    
-    std::vector<std::pair<std::string, std::string>> tasks;
-    
-    for (auto& [key, value] : inverted_index_multiple) {
-        tasks.push_back({key, "multiple"});
+    if (lsh.getContentHash() != LSH::content_hash(ontologies)) {
+        ScopedStage stage("lsh_sync");
+        size_t changes = lsh.sync_terms(ontologies);
+        std::cout << "Applied " << changes << " ontology changes to " << bin_filename << std::endl;
+        lsh.compact_async();
+        return true;
     }
+    return false;
+}
 
-    for (auto& [key, value] : inverted_index_single) {
-        tasks.push_back({key, "single"});
+// The ontology is kept next to the JSON file as a preprocessed snapshot, which later runs map
+// instead of parsing the JSON again.
+std::string ontology_snapshot_path(const std::string& ontologyPath) {
+    return get_base_filename(ontologyPath) + ".snap";
+}
+
+// Creates a private directory for the shard sockets, so no other user can predict or take
+// their paths.
+bool make_shard_directory(std::string& directory) {
+    const char* tmp = std::getenv("TMPDIR");
+    std::string pattern = std::string(tmp && *tmp ? tmp : "/tmp") + "/ontology-matching-XXXXXX";
+    if (!::mkdtemp(pattern.data())) {
+        std::cerr << "Failed to create a directory for the shard sockets: " << std::strerror(errno) << std::endl;
+        return false;
     }
+    directory = pattern;
+    return true;
+}
 
-    size_t chunk_size = (tasks.size() + max_concurrent_tasks - 1) / max_concurrent_tasks;
-    std::vector<std::thread> workers;
+// Socket path of shard `shard` in the coordinator's directory.
+std::string shard_socket_path(const std::string& directory, int shard) {
+    return directory + "/shard" + std::to_string(shard) + ".sock";
+}
 
-    auto start_time = std::chrono::high_resolution_clock::now();
+// Removes the sockets of workers that did not exit cleanly, then the directory.
+void remove_shard_directory(const std::string& directory, int numShards) {
+    for (int shard = 0; shard < numShards; ++shard) {
+        ::unlink(shard_socket_path(directory, shard).c_str());
+    }
+    ::rmdir(directory.c_str());
+}
+
+// Starts one --shard-worker process per shard, each this program loading the ontology itself,
+// and connects `coordinator` to them.
+bool start_shard_workers(ShardCoordinator& coordinator, const std::string& directory, const std::string& ontologyPath,
+                         const MatchOptions& options) {
+    // The workers share the machine, so split the thread budget between them.
+    int threads = options.threads > 0 ? options.threads : static_cast<int>(std::thread::hardware_concurrency());
+    int workerThreads = std::max(1, threads / options.shards);
+    std::vector<std::string> socketPaths;
+    for (int shard = 0; shard < options.shards; ++shard) {
+        socketPaths.push_back(shard_socket_path(directory, shard));
+        std::vector<std::string> args = {"EntityMatching", ontologyPath, "--shard-worker", std::to_string(shard),
+                                         std::to_string(options.shards), socketPaths.back(),
+                                         "--bands", std::to_string(options.bands),
+                                         "--threads", std::to_string(workerThreads)};
+        if (!options.tuneBandings) {
+            args.push_back("--no-tune");
+        }
+        pid_t pid = spawn_process("/proc/self/exe", args);
+        if (pid < 0) {
+            return false;
+        }
+        coordinator.adopt(pid);
+    }
+    ScopedStage stage("shard_start");
+    return coordinator.connect(socketPaths);
+}
+
+// Worker side of --shards: indexes the terms whose global ID is `shard` mod `numShards` and
+// answers the coordinator on `socketPath` until it shuts the worker down.
+int serve_shard(const std::string& ontologyPath, int shard, int numShards, const std::string& socketPath,
+                const MatchOptions& options) {
+    std::unique_ptr<tbb::global_control> threadLimit;
+    if (options.threads > 0) {
+        threadLimit = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, options.threads);
+    }
+    Ontology ontology;
+    if (!ontology.load(ontologyPath, ontology_snapshot_path(ontologyPath))) {
+        return 1;
+    }
+    std::vector<std::string> terms = distinct_terms(ontology.labels());
+
+    std::vector<std::string> ownTerms;
+    std::vector<uint32_t> globalIDs;
+    for (uint32_t id = shard; id < terms.size(); id += numShards) {
+        ownTerms.push_back(terms[id]);
+        globalIDs.push_back(id);
+    }
+    LSH lsh(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, 3);
+    add_query_bandings(lsh, options);
+    lsh.bulk_build(ownTerms);
+
+    ShardServer server(lsh, std::move(globalIDs));
+    return server.serve(socketPath) ? 0 : 1;
+}
 
-    for (size_t i = 0; i < max_concurrent_tasks; ++i) {
-        size_t start = i * chunk_size;
-        size_t end = std::min(start + chunk_size, tasks.size());
-        std::vector<std::pair<std::string, std::string>> chunk_tasks(tasks.begin() + start, tasks.begin() + end);
+bool match(std::string ontologyPath, std::string ingredientPath, std::string outputPath, const MatchOptions& options = {}) {
+    // Every stage runs on TBB's work-stealing scheduler, so this one limit covers them all.
+    std::unique_ptr<tbb::global_control> threadLimit;
+    if (options.threads > 0) {
+        threadLimit = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, options.threads);
+    }
+    int n = 3;
+    LSH lsh(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, n);
+    add_query_bandings(lsh, options);
+    std::string filename = outputPath;
 
-        workers.emplace_back(process_chunk, i, chunk_tasks,
-                            std::ref(lsh), n);
+    Ontology ontology;
+    std::vector<std::string> ontologies;
+    {
+        ScopedStage stage("load_ontology");
+        if (!ontology.load(ontologyPath, ontology_snapshot_path(ontologyPath))) {
+            return false;
+        }
+        ontologies = ontology.labels();
     }
 
-    for (auto& worker : workers) {
-        worker.join();
+    if (options.validationSample > 0) {
+        validate_bandings(lsh, ontologies, options);
+    }
+
+    // With --cache, query results are kept in [ontology].cache between runs.
+    std::string cache_filename = options.cacheFile ? get_base_filename(ontologyPath) + ".cache" : std::string();
+    auto start_time = std::chrono::high_resolution_clock::now();
+    if (options.forestTrees > 0) {
+        // The forest is rebuilt on every run; it is not saved.
+        LSHForest forest(options.forestTrees, options.hashFuncs, MinHashScheme::Remix, n);
+        {
+            ScopedStage stage("forest_build");
+            forest.bulk_build(ontologies);
+        }
+        if (!match_candidates(cache_filename, ingredientPath, forest, forest.fingerprint(), options)) {
+            return false;
+        }
+    }
+    else if (options.shards > 0) {
+        std::string socketDirectory;
+        if (!make_shard_directory(socketDirectory)) {
+            return false;
+        }
+        ShardCoordinator coordinator(distinct_terms(ontologies));
+        bool matched = start_shard_workers(coordinator, socketDirectory, ontologyPath, options) &&
+                       match_candidates(cache_filename, ingredientPath, coordinator, coordinator.fingerprint(), options);
+        coordinator.shutdown();
+        remove_shard_directory(socketDirectory, options.shards);
+        if (!matched) {
+            return false;
+        }
+    }
+    else {
+        std::string bin_filename = get_base_filename(ontologyPath) + ".bin";
+        bool indexChanged = prepare_index(lsh, bin_filename, ontologies, options);
+
+        if (!match_candidates(cache_filename, ingredientPath, lsh, lsh.fingerprint(), options)) {
+            return false;
+        }
+
+        LSH::QueryStats queryStats = lsh.query_stats();
+        Metrics& metrics = Metrics::instance();
+        metrics.addCounter("queries", queryStats.queries);
+        metrics.addCounter("band_hits", queryStats.bandHits);
+        metrics.addCounter("candidates", queryStats.candidates);
+        metrics.addCounter("verified_matches", queryStats.matches);
+        if (indexChanged) {
+            {
+                ScopedStage stage("lsh_compaction_wait");
+                lsh.wait_for_compaction();
+            }
+            ScopedStage stage("lsh_save");
+            lsh.save_to_disk(bin_filename);
+        }
     }
     
     auto stop_time = std::chrono::high_resolution_clock::now();
@@ -198,43 +712,203 @@ void match(std::string ontologyPath, std::string ingredientPath, std::string out
     int minutes = (total_seconds % 3600) / 60;
     int seconds = total_seconds % 60;
     
-    std::ofstream outFile(filename);
+    ScopedStage outputStage("output");
+    bool written = write_results(filename, ontology_terms(ontology), options);
+    inverted_index_multiple.clear();
+    inverted_index_single.clear();
+    return written;
+}
 
-    if (!outFile.is_open()) {
-        std::cerr << "Failed to open " << filename << std::endl;
-        return;
+// Server side of --serve: keeps the ontology and its index resident and answers match requests
+// on `socketPath` until a client asks it to stop.
+int serve_daemon(const std::string& ontologyPath, const std::string& socketPath, const MatchOptions& options) {
+    std::unique_ptr<tbb::global_control> threadLimit;
+    if (options.threads > 0) {
+        threadLimit = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, options.threads);
     }
+    Ontology ontology;
+    if (!ontology.load(ontologyPath, ontology_snapshot_path(ontologyPath))) {
+        return 1;
+    }
+    std::vector<OntologyTerm> terms = ontology_terms(ontology);
+    std::vector<std::string> ontologies = ontology.labels();
 
-    std::unordered_map<std::string, std::unordered_set<std::string>> matches;
-    for (auto& [key, value] : ingredients_matches) {
-        if (inverted_index_multiple.find(key) != inverted_index_multiple.end()) {
-            auto lst = inverted_index_multiple[key];
-            for (auto& element : lst) {
-                matches[element].insert(value.begin(), value.end());
-            }
+    LSH lsh(options.bands, options.hashFuncs, MinHashScheme::Remix, 16, 3);
+    add_query_bandings(lsh, options);
+    std::string bin_filename = get_base_filename(ontologyPath) + ".bin";
+    if (prepare_index(lsh, bin_filename, ontologies, options)) {
+        lsh.wait_for_compaction();
+        lsh.save_to_disk(bin_filename);
+    }
+
+    // The same queries match() runs: word bigrams at 0.5 and single words at 0.9.
+    const TextNormalizer normalizer(MATCH_STOP_WORDS);
+    auto planner = [&normalizer](std::string_view ingredient, std::vector<std::pair<std::string, double>>& queries) {
+        std::string normalized;
+        std::vector<std::string_view> words;
+        std::vector<std::string_view> ngrams;
+        normalizer.normalize(ingredient, normalized, words);
+        text_to_ngram_views(normalized, 2, ngrams);
+        for (std::string_view w : ngrams) {
+            queries.emplace_back(std::string(w), 0.5);
         }
-        else if (inverted_index_single.find(key) != inverted_index_single.end()) {
-            auto lst = inverted_index_single[key];
-            for (auto& element : lst) {
-                matches[element].insert(value.begin(), value.end());
-            }
+        ngrams.clear();
+        text_to_ngram_views(normalized, 1, ngrams);
+        for (std::string_view w : ngrams) {
+            queries.emplace_back(std::string(w), 0.9);
         }
+    };
+
+    DaemonOptions daemonOptions;
+    daemonOptions.socketPath = socketPath;
+    daemonOptions.latencyBudgetUs = options.batchWindowUs;
+    daemonOptions.maxBatchQueries = options.maxBatchQueries;
+    daemonOptions.probes = options.probes;
+    MatchDaemon daemon(lsh, terms, planner, daemonOptions);
+    if (!daemon.run()) {
+        return 1;
     }
+    std::cout << daemon.stats().dump(1) << std::endl;
+    return 0;
+}
 
-    for (auto& [key, value] : matches) {
-        outFile << key << std::endl;
-        for (auto& v : value) {
-            outFile << "(" << index[v].first << " " << index[v].second << "), ";
+// Client side of --connect. With a candidate file and an output path, runs match() with the
+// daemon's index in place of its own: the candidates are indexed and written here, by the same
+// code, so the output is byte for byte what match() writes with the same index and options.
+// With --stop, shuts the daemon down; otherwise prints the daemon's statistics.
+int run_client(const std::string& socketPath, const std::vector<std::string>& paths, bool stopDaemon,
+               const MatchOptions& options) {
+    MatchClient client;
+    if (!client.connect(socketPath)) {
+        return 1;
+    }
+    if (stopDaemon) {
+        return client.shutdown() ? 0 : 1;
+    }
+    if (paths.size() != 2) {
+        std::string stats;
+        if (!client.stats(stats)) {
+            return 1;
         }
-        outFile << "\n";
+        std::cout << nlohmann::json::parse(stats).dump(1) << std::endl;
+        return 0;
     }
 
+    std::unique_ptr<tbb::global_control> threadLimit;
+    if (options.threads > 0) {
+        threadLimit = std::make_unique<tbb::global_control>(tbb::global_control::max_allowed_parallelism, options.threads);
+    }
+    // The daemon caches results itself, so the client keeps none between runs.
+    if (!client.loadTerms() || !match_candidates(std::string(), paths[0], client, 0, options)) {
+        return 1;
+    }
+    bool written = write_results(paths[1], client.getTerms(), options);
+    inverted_index_multiple.clear();
+    inverted_index_single.clear();
+    return written ? 0 : 1;
 }
 
 int main(int argc, char** argv) {
-    if (argc != 4) {
-        std::cout << "Usage: ./EntityMatching [path_to_ontology] [path_to_candiates] [path_to_output]\n";
+    MatchOptions options;
+    std::vector<std::string> paths;
+    // Set by --shard-worker, which the coordinator passes to the processes it starts.
+    int workerShard = 0;
+    int workerCount = 0;
+    std::string workerSocket;
+    std::string serveSocket;
+    std::string connectSocket;
+    bool stopDaemon = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--topk" && i + 1 < argc) {
+            options.topK = std::stoul(argv[++i]);
+        }
+        else if (arg == "--cache") {
+            options.cacheFile = true;
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::stoi(argv[++i]);
+        }
+        else if (arg == "--bands" && i + 1 < argc) {
+            options.bands = std::stoi(argv[++i]);
+        }
+        else if (arg == "--shards" && i + 1 < argc) {
+            options.shards = std::stoi(argv[++i]);
+        }
+        else if (arg == "--shard-worker" && i + 3 < argc) {
+            workerShard = std::stoi(argv[++i]);
+            workerCount = std::stoi(argv[++i]);
+            workerSocket = argv[++i];
+        }
+        else if (arg == "--format" && i + 1 < argc) {
+            if (!parse_output_format(argv[++i], options.outputFormat)) {
+                return -1;
+            }
+        }
+        else if (arg == "--serve" && i + 1 < argc) {
+            serveSocket = argv[++i];
+        }
+        else if (arg == "--batch-window" && i + 1 < argc) {
+            options.batchWindowUs = std::stoi(argv[++i]);
+        }
+        else if (arg == "--max-batch" && i + 1 < argc) {
+            options.maxBatchQueries = std::stoul(argv[++i]);
+        }
+        else if (arg == "--connect" && i + 1 < argc) {
+            connectSocket = argv[++i];
+        }
+        else if (arg == "--stop") {
+            stopDaemon = true;
+        }
+        else if (arg == "--forest" && i + 1 < argc) {
+            options.forestTrees = std::stoi(argv[++i]);
+        }
+        else if (arg == "--probes" && i + 1 < argc) {
+            options.probes = std::stoi(argv[++i]);
+        }
+        else if (arg == "--no-tune") {
+            options.tuneBandings = false;
+        }
+        else if (arg == "--verify-index") {
+            options.verifyIndex = true;
+        }
+        else if (arg == "--validate-banding" && i + 1 < argc) {
+            options.validationSample = std::stoul(argv[++i]);
+        }
+        else if (arg == "--metrics" && i + 1 < argc) {
+            options.metricsPath = argv[++i];
+        }
+        else if (arg == "--trace" && i + 1 < argc) {
+            options.tracePath = argv[++i];
+            Metrics::instance().enableTrace();
+        }
+        else {
+            paths.push_back(arg);
+        }
+    }
+
+    if (!connectSocket.empty()) {
+        return run_client(connectSocket, paths, stopDaemon, options);
+    }
+    if (!serveSocket.empty() && paths.size() == 1) {
+        return serve_daemon(paths[0], serveSocket, options);
+    }
+    if (workerCount > 0 && paths.size() == 1) {
+        return serve_shard(paths[0], workerShard, workerCount, workerSocket, options);
+    }
+    if (paths.size() != 3) {
+        std::cout << "Usage: ./EntityMatching [path_to_ontology] [path_to_candiates] [path_to_output] [--topk k] [--threads n] [--cache] [--bands n] [--probes n] [--forest trees] [--shards n] [--format text|jsonl|binary] [--no-tune] [--validate-banding n] [--verify-index] [--metrics file] [--trace file]\n"
+                  << "       ./EntityMatching [path_to_ontology] --serve socket [--batch-window us] [--max-batch n] [--bands n] [--probes n] [--no-tune]\n"
+                  << "       ./EntityMatching --connect socket [path_to_candiates path_to_output [--topk k] [--format text|jsonl|binary] | --stop]\n";
         return -1;
     }
-    match(argv[1], argv[2], argv[3]);
+    bool matched = match(paths[0], paths[1], paths[2], options);
+
+    if (!options.metricsPath.empty()) {
+        Metrics::instance().writeReport(options.metricsPath);
+    }
+    if (!options.tracePath.empty()) {
+        Metrics::instance().writeTrace(options.tracePath);
+    }
+    return matched ? 0 : 1;
 }
\ No newline at end of file
@@ -0,0 +1,63 @@
+#!/bin/bash
+# Checks that --connect writes the same files as a direct run on the same input, in every
+# output format and with --topk.
+# Usage: daemon_client_output.sh path/to/EntityMatching path/to/tests/data
+set -u
+matcher=$1
+data=$2
+work=$(mktemp -d)
+daemon=
+cleanup() {
+    if [ -n "$daemon" ]; then
+        kill "$daemon" 2>/dev/null
+        wait "$daemon" 2>/dev/null
+    fi
+    rm -rf "$work"
+}
+trap cleanup EXIT
+
+# The matcher writes its index and snapshot next to the ontology.
+cp "$data/ontology.json" "$data/candidates.csv" "$work/"
+cd "$work" || exit 1
+
+"$matcher" ontology.json --serve daemon.sock > daemon.log 2>&1 &
+daemon=$!
+for _ in $(seq 100); do
+    [ -S daemon.sock ] && break
+    sleep 0.1
+done
+
+status=0
+check() {
+    local name=$1
+    shift
+    if ! "$matcher" ontology.json candidates.csv "direct.$name" "$@" > /dev/null; then
+        echo "direct run failed: $name"
+        status=1
+        return
+    fi
+    if ! "$matcher" --connect daemon.sock candidates.csv "client.$name" "$@"; then
+        echo "client run failed: $name"
+        status=1
+        return
+    fi
+    if ! cmp "direct.$name" "client.$name"; then
+        status=1
+    fi
+    if [ -e "direct.$name.dict.json" ] && ! cmp "direct.$name.dict.json" "client.$name.dict.json"; then
+        status=1
+    fi
+}
+
+check text
+check jsonl --format jsonl
+check binary --format binary
+check topk --topk 3
+check topk.jsonl --topk 3 --format jsonl
+
+if ! "$matcher" --connect daemon.sock --stop; then
+    status=1
+fi
+wait "$daemon"
+daemon=
+exit $status